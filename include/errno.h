@@ -0,0 +1,18 @@
+/*
+ * errno.h -- define error numbers returned by the kernel
+ *
+ * System calls return the negated number on failure. The values match the
+ * ones used by Linux.
+ */
+
+#ifndef ERRNO_H
+#define ERRNO_H
+
+#define ENOENT      2   /* No such file or directory */
+#define ESRCH       3   /* No such process */
+#define EFAULT      14  /* Bad address */
+#define EBUSY       16  /* Device or resource busy */
+#define EINVAL      22  /* Invalid argument */
+#define ENOSYS      38  /* Function not implemented */
+
+#endif /* end of include guard: ERRNO_H */
@@ -0,0 +1,191 @@
+/*
+ * apic.c -- Defines the Local APIC driver.
+ */
+
+#include "apic.h"
+#include "clock.h"
+#include "isr.h"
+#include "paging.h"
+#include "timer.h"
+
+/* Register offsets, see Intel SDM Vol. 3, chapter 10. */
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ESR       0x280
+#define LAPIC_ICR_LO    0x300
+#define LAPIC_ICR_HI    0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_ICR 0x380
+#define LAPIC_TIMER_CCR 0x390
+#define LAPIC_TIMER_DCR 0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIV_16  0x3
+
+#define ICR_INIT        0x00000500
+#define ICR_STARTUP     0x00000600
+#define ICR_PENDING     0x00001000
+#define ICR_ASSERT      0x00004000
+#define ICR_LEVEL       0x00008000
+
+#define MSR_APIC_BASE   0x1B
+#define CPUID_EDX_APIC  (1 << 9)
+
+/* Defined in timer.c */
+extern u32int timer_frequency;
+
+static volatile u32int *lapic = 0;
+
+/* Number of timer counts (with divider 16) in one PIT tick. */
+static u32int lapic_timer_ticks;
+
+static u32int lapic_read(u32int reg)
+{
+    return lapic[reg / 4];
+}
+
+static void lapic_write(u32int reg, u32int value)
+{
+    lapic[reg / 4] = value;
+    /* Wait for the write to finish by reading. */
+    lapic[LAPIC_ID / 4];
+}
+
+static void spurious_handler(registers_t *regs)
+{
+    /* Spurious interrupts must not be acknowledged. */
+}
+
+/*
+ * Enable the Local APIC of the executing processor.
+ */
+static void lapic_enable(void)
+{
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    /* Clear error status, it requires two writes. */
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_EOI, 0);
+    /* Accept all interrupts. */
+    lapic_write(LAPIC_TPR, 0);
+}
+
+/*
+ * Count how many Local APIC timer counts elapse during one PIT tick.
+ */
+static void lapic_timer_calibrate(void)
+{
+    lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    /* Synchronise with the start of a tick. */
+    u32int start = tick;
+    while (tick == start);
+
+    lapic_write(LAPIC_TIMER_ICR, 0xFFFFFFFF);
+    start = tick;
+    while (tick == start);
+    lapic_timer_ticks = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CCR);
+    lapic_write(LAPIC_TIMER_ICR, 0);
+}
+
+int init_lapic(void)
+{
+    u32int edx;
+    cpuid(1, 0, 0, 0, &edx);
+    if (!(edx & CPUID_EDX_APIC))
+        return 0;
+
+    u32int base = (u32int) rdmsr(MSR_APIC_BASE) & 0xFFFFF000;
+    map_mmio(base);
+    lapic = (u32int *) base;
+
+    register_interrupt_handler(LAPIC_SPURIOUS_VECTOR, &spurious_handler);
+    lapic_enable();
+    lapic_timer_calibrate();
+    return 1;
+}
+
+void init_ap_lapic(void)
+{
+    lapic_enable();
+}
+
+int lapic_present(void)
+{
+    return lapic != 0;
+}
+
+u8int lapic_id(void)
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void)
+{
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+/*
+ * Send an inter-processor interrupt and wait until it is delivered.
+ */
+static void lapic_send_ipi(u8int apic_id, u32int icr)
+{
+    lapic_write(LAPIC_ICR_HI, (u32int) apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING)
+        asm volatile ("pause");
+}
+
+void lapic_send_init(u8int apic_id)
+{
+    lapic_send_ipi(apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+}
+
+void lapic_send_startup(u8int apic_id, u8int vector)
+{
+    lapic_send_ipi(apic_id, ICR_STARTUP | vector);
+}
+
+void lapic_send_fixed(u8int apic_id, u8int vector)
+{
+    lapic_send_ipi(apic_id, ICR_ASSERT | vector);
+}
+
+void lapic_timer_start(void)
+{
+    lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_ICR, lapic_timer_ticks);
+}
+
+void lapic_timer_oneshot(u64int ns)
+{
+    /* Longer waits would overflow the computation below, the handler
+     * simply programs the timer again. */
+    if (ns > NSEC_PER_SEC)
+        ns = NSEC_PER_SEC;
+    u32int count = (u32int) div_u64_u32(ns * lapic_timer_ticks,
+            NSEC_PER_SEC / timer_frequency, 0);
+    if (!count)
+        count = 1;
+
+    /* Clearing the periodic bit selects the one-shot mode. */
+    lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_ICR, count);
+}
+
+void lapic_timer_stop(void)
+{
+    lapic_write(LAPIC_TIMER_ICR, 0);
+}
@@ -0,0 +1,96 @@
+/**
+ * @file    apic.h
+ *
+ * Defines the interface to the Local APIC.
+ *
+ * Every processor has its own Local APIC. It receives interrupts for the
+ * processor, sends inter-processor interrupts and contains a timer.
+ */
+
+#ifndef APIC_H
+#define APIC_H
+
+#include "common.h"
+
+/** Default physical address of the Local APIC registers. */
+#define LAPIC_DEFAULT_BASE      0xFEE00000
+
+#define LAPIC_TIMER_VECTOR      48      /**< Vector of the Local APIC timer */
+#define LAPIC_SPURIOUS_VECTOR   0xFF    /**< Vector of spurious interrupts */
+
+/**
+ * Detect and enable Local APIC of the bootstrap processor. The timer must
+ * already be running, it is used to calibrate the Local APIC timer.
+ *
+ * @return nonzero if the Local APIC is present
+ */
+int init_lapic(void);
+
+/**
+ * Enable the Local APIC of an application processor. init_lapic() must
+ * have been called on the bootstrap processor before.
+ */
+void init_ap_lapic(void);
+
+/**
+ * Check whether the Local APIC was found and enabled.
+ *
+ * @return nonzero if init_lapic() succeeded
+ */
+int lapic_present(void);
+
+/**
+ * Get ID of the Local APIC of the executing processor.
+ */
+u8int lapic_id(void);
+
+/**
+ * Signal end of interrupt to the Local APIC.
+ */
+void lapic_eoi(void);
+
+/**
+ * Send INIT inter-processor interrupt.
+ *
+ * @param apic_id   Local APIC ID of the target processor
+ */
+void lapic_send_init(u8int apic_id);
+
+/**
+ * Send STARTUP inter-processor interrupt. The target processor starts
+ * executing in real mode at address `vector * 0x1000`.
+ *
+ * @param apic_id   Local APIC ID of the target processor
+ * @param vector    page number of the startup code
+ */
+void lapic_send_startup(u8int apic_id, u8int vector);
+
+/**
+ * Send a fixed inter-processor interrupt.
+ *
+ * @param apic_id   Local APIC ID of the target processor
+ * @param vector    interrupt vector raised on the target
+ */
+void lapic_send_fixed(u8int apic_id, u8int vector);
+
+/**
+ * Start the Local APIC timer of the executing processor. It fires
+ * #LAPIC_TIMER_VECTOR with the same frequency as the PIT.
+ */
+void lapic_timer_start(void);
+
+/**
+ * Make the Local APIC timer of the executing processor fire
+ * #LAPIC_TIMER_VECTOR once after given time. Times longer than a second
+ * are cut to a second.
+ *
+ * @param ns    time from now in nanoseconds
+ */
+void lapic_timer_oneshot(u64int ns);
+
+/**
+ * Stop the Local APIC timer of the executing processor.
+ */
+void lapic_timer_stop(void);
+
+#endif /* end of include guard: APIC_H */
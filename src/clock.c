@@ -0,0 +1,123 @@
+/*
+ * clock.c -- Defines the high resolution clock based on the time stamp
+ *            counter.
+ */
+
+#include "clock.h"
+#include "monitor.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "vdso.h"
+
+#define CPUID_EDX_TSC   (1 << 4)
+
+/* Calibrate during 50 ms, the count has to fit into 16 bits. */
+#define CALIBRATE_HZ    20
+#define CALIBRATE_COUNT (PIT_FREQ / CALIBRATE_HZ)
+
+/* Defined in timer.c */
+extern u32int timer_frequency;
+
+/* Cycles per millisecond and the value of the counter at boot. */
+static u32int cycles_khz;
+static u64int cycles_base;
+static int have_tsc;
+
+/* Nanoseconds are computed as (cycles * mult) >> shift. */
+static u32int mult;
+static u32int shift;
+
+/*
+ * Count time stamp counter cycles during one run of PIT channel 2. An
+ * interrupt between starting the PIT and reading the counter would make
+ * the count too small, so interrupts are disabled.
+ */
+static u64int calibrate_tsc(void)
+{
+    u32int flags = irq_save();
+    pit_oneshot_start(CALIBRATE_COUNT);
+    u64int start = rdtsc();
+    while (!pit_oneshot_expired());
+    u64int cycles = rdtsc() - start;
+    irq_restore(flags);
+    return cycles;
+}
+
+/*
+ * Find the largest shift which keeps the multiplier in 32 bits.
+ */
+static void calc_mult_shift(u32int khz)
+{
+    u64int m = 0;
+    for (shift = 32; shift > 0; shift--) {
+        m = div_u64_u32((u64int) (NSEC_PER_SEC / 1000) << shift, khz, 0);
+        if (m <= 0xFFFFFFFF)
+            break;
+    }
+    mult = (u32int) m;
+}
+
+void init_clock(void)
+{
+    u32int edx;
+    cpuid(1, 0, 0, 0, &edx);
+    have_tsc = (edx & CPUID_EDX_TSC) != 0;
+
+    if (have_tsc) {
+        /* The first run warms up the caches. Take the shortest of the
+         * following ones, longer runs were delayed by system management
+         * interrupts or an emulator. */
+        u64int best = calibrate_tsc();
+        int i;
+        for (i = 0; i < 3; i++) {
+            u64int c = calibrate_tsc();
+            if (c < best)
+                best = c;
+        }
+        cycles_khz = (u32int) best / (1000 / CALIBRATE_HZ);
+        cycles_base = rdtsc();
+        calc_mult_shift(cycles_khz);
+        monitor_print("TSC runs at %u kHz\n", cycles_khz);
+    } else {
+        /* Count the timer ticks instead. */
+        cycles_khz = 0;
+        cycles_base = tick;
+        mult = NSEC_PER_SEC / timer_frequency;
+        shift = 0;
+        monitor_print("No TSC, clock has %u Hz resolution\n", timer_frequency);
+    }
+    vdso_set_clock(cycles_khz, cycles_base, mult, shift);
+}
+
+u64int ktime_cycles(void)
+{
+    if (have_tsc)
+        return rdtsc() - cycles_base;
+    return tick - cycles_base;
+}
+
+u64int cycles_to_ns(u64int cycles)
+{
+    /* Split the multiplication, so that it does not overflow 64 bits. */
+    u64int hi = (cycles >> 32) * mult;
+    u64int lo = (cycles & 0xFFFFFFFF) * mult;
+    if (shift == 0)
+        return (hi << 32) + lo;
+    return (hi << (32 - shift)) + (lo >> shift);
+}
+
+u64int ktime_ns(void)
+{
+    return cycles_to_ns(ktime_cycles());
+}
+
+u32int clock_khz(void)
+{
+    return cycles_khz;
+}
+
+int gettime(u64int *ns)
+{
+    *ns = ktime_ns();
+    return 0;
+}
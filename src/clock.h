@@ -0,0 +1,63 @@
+/**
+ * @file    clock.h
+ *
+ * Defines the interface to the high resolution clock.
+ *
+ * The clock counts processor cycles with the time stamp counter, which is
+ * calibrated against PIT channel 2 at boot. When the processor has no time
+ * stamp counter, the clock falls back to the timer ticks.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "common.h"
+
+/** Number of nanoseconds in a second */
+#define NSEC_PER_SEC    1000000000
+
+/**
+ * Calibrate the time stamp counter. The clock starts counting from zero.
+ * The timer must already be initialised.
+ */
+void init_clock(void);
+
+/**
+ * Get number of cycles elapsed since init_clock().
+ *
+ * @return cycle count
+ */
+u64int ktime_cycles(void);
+
+/**
+ * Get number of nanoseconds elapsed since init_clock().
+ *
+ * @return time in nanoseconds
+ */
+u64int ktime_ns(void);
+
+/**
+ * Convert a number of cycles to nanoseconds.
+ *
+ * @param cycles    difference of two ktime_cycles() values
+ * @return time in nanoseconds
+ */
+u64int cycles_to_ns(u64int cycles);
+
+/**
+ * Get frequency of the time stamp counter.
+ *
+ * @return number of cycles per millisecond, zero if the clock counts timer
+ *         ticks
+ */
+u32int clock_khz(void);
+
+/**
+ * Store the current time for a system call.
+ *
+ * @param[out] ns   where to store the time in nanoseconds
+ * @return zero
+ */
+int gettime(u64int *ns);
+
+#endif /* end of include guard: CLOCK_H */
@@ -25,6 +25,72 @@ u16int inw(u16int port)
     return ret;
 }
 
+void cpuid(u32int leaf, u32int *eax, u32int *ebx, u32int *ecx, u32int *edx)
+{
+    u32int a, b, c, d;
+    asm volatile ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+                          : "0" (leaf), "2" (0));
+    if (eax) *eax = a;
+    if (ebx) *ebx = b;
+    if (ecx) *ecx = c;
+    if (edx) *edx = d;
+}
+
+u64int rdmsr(u32int msr)
+{
+    u32int lo, hi;
+    asm volatile ("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return ((u64int) hi << 32) | lo;
+}
+
+void wrmsr(u32int msr, u64int value)
+{
+    asm volatile ("wrmsr" :: "c" (msr), "a" ((u32int) value),
+                             "d" ((u32int) (value >> 32)));
+}
+
+u64int rdtsc(void)
+{
+    u32int lo, hi;
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((u64int) hi << 32) | lo;
+}
+
+u64int div_u64_u32(u64int dividend, u32int divisor, u32int *rem)
+{
+    u32int hi = dividend >> 32, lo = (u32int) dividend;
+    u32int qhi = 0, qlo, r = 0;
+
+    /* Divide the high word first, so that the second divl can't overflow. */
+    if (hi >= divisor) {
+        qhi = hi / divisor;
+        hi %= divisor;
+    }
+    asm ("divl %4" : "=a" (qlo), "=d" (r) : "0" (lo), "1" (hi), "rm" (divisor));
+    if (rem)
+        *rem = r;
+    return ((u64int) qhi << 32) | qlo;
+}
+
+u32int crc32(const void *data, u32int len)
+{
+    /* One entry per nibble keeps the table small. */
+    static const u32int table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    const u8int *p = data;
+    u32int crc = 0xFFFFFFFF;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0xF];
+        crc = (crc >> 4) ^ table[crc & 0xF];
+    }
+    return ~crc;
+}
+
 void * memset(u8int *dest, u8int val, u32int len)
 {
     u8int *tmp = dest;
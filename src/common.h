@@ -21,6 +21,10 @@ typedef          short s16int;
 typedef unsigned char  u8int;
 /** 8-bit signed int */
 typedef          char  s8int;
+/** 64-bit unsigned int */
+typedef unsigned long long u64int;
+/** 64-bit signed int */
+typedef          long long s64int;
 
 /**
  * Write a byte out to the specified port.
@@ -46,15 +50,71 @@ u8int inb(u16int port);
  */
 u16int inw(u16int port);
 
+/**
+ * Execute the CPUID instruction.
+ *
+ * @param leaf      value of eax to query
+ * @param[out] eax  where to store resulting eax [null]
+ * @param[out] ebx  where to store resulting ebx [null]
+ * @param[out] ecx  where to store resulting ecx [null]
+ * @param[out] edx  where to store resulting edx [null]
+ */
+void cpuid(u32int leaf, u32int *eax, u32int *ebx, u32int *ecx, u32int *edx);
+
+/**
+ * Read a model specific register.
+ *
+ * @param msr   number of the register
+ * @return read value
+ */
+u64int rdmsr(u32int msr);
+
+/**
+ * Write a model specific register.
+ *
+ * @param msr   number of the register
+ * @param value value to be written
+ */
+void wrmsr(u32int msr, u64int value);
+
+/**
+ * Read the time stamp counter.
+ *
+ * @return number of cycles since reset
+ */
+u64int rdtsc(void);
+
+/**
+ * Divide 64-bit number by a 32-bit one. The compiler would call libgcc for
+ * the 64-bit division, which we do not link with.
+ *
+ * @param dividend  number to be divided
+ * @param divisor   nonzero divisor
+ * @param[out] rem  where to store the remainder [null]
+ * @return quotient
+ */
+u64int div_u64_u32(u64int dividend, u32int divisor, u32int *rem);
+
+/**
+ * Compute the CRC-32 (IEEE 802.3) of a buffer, as used by zlib.
+ *
+ * @param data  start of the buffer
+ * @param len   length of the buffer in bytes
+ * @return checksum
+ */
+u32int crc32(const void *data, u32int len);
+
 /* Doxygen does not like the __attribute__ syntax, so hide it from it. */
 #ifndef DOXYGEN_RUNNING
 #define PACKED          __attribute__((packed))
 #define NORETURN        __attribute__((noreturn))
 #define FORMAT(a,b,c)   __attribute__((format(a,b,c)))
+#define ALIGNED(n)      __attribute__((aligned(n)))
 #else
 #define PACKED          /**< Defines a structure as packed */
 #define NORETURN        /**< Defines a function as non-returning */
 #define FORMAT(a,b,c)   /**< Defines a function as printf-like */
+#define ALIGNED(n)      /**< Defines minimal alignment of a variable */
 #endif /* DOXYGEN_RUNNING */
 
 #define PIC1            0x20        /**< Master PIC IO port */
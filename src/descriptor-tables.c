@@ -9,6 +9,7 @@
 #include "common.h"
 #include "descriptor-tables.h"
 #include "isr.h"
+#include "smp.h"
 
 /**
  * This structure contains the value of one GDT entry. We use the attribute
@@ -140,26 +141,66 @@ struct tss_entry_struct {
     u16int iomap_base;  /**< Unused */
 } PACKED;
 
+/** Number of entries in the GDT. */
+#define GDT_ENTRIES 8
+
+/** Selector of the TSS used to handle double faults. */
+#define DOUBLE_FAULT_TSS    0x38
+
+/**
+ * Descriptor tables private to one processor.
+ */
+struct cpu_tables {
+    /** The GDT of the processor */
+    struct gdt_entry_struct gdt_entries[GDT_ENTRIES];
+    /** Pointer to gdt_entries suitable for 'lgdt' */
+    struct gdt_ptr_struct   gdt_ptr;
+    /** The TSS of the processor */
+    struct tss_entry_struct tss_entry;
+    /** TSS switched to on double fault, so that it is handled on a fresh
+     * stack even when the kernel stack overflowed. */
+    struct tss_entry_struct df_tss;
+    /** Stack of the double fault handler */
+    u8int df_stack[4096];
+};
+
 /* This lets us call ASM functions from the C code. */
 extern void gdt_flush(u32int);
 extern void idt_flush(u32int);
 extern void tss_flush(void);
 
 /* Internal functions */
-static void init_gdt(void);
-static void gdt_set_gate(s32int, u32int, u32int, u8int, u8int);
+static void init_gdt(u32int);
+static void gdt_set_gate(struct gdt_entry_struct *,
+                         s32int, u32int, u32int, u8int, u8int);
 static void init_idt(void);
 static void idt_set_gate(u8int, u32int, u16int, u8int);
-static void write_tss(s32int, u16int, u32int);
+static void write_tss(struct cpu_tables *, s32int, u16int, u32int);
+static void write_df_tss(struct cpu_tables *, s32int);
+static void init_sysenter(struct cpu_tables *);
 
-struct gdt_entry_struct gdt_entries[6];
-struct gdt_ptr_struct   gdt_ptr;
+struct cpu_tables       cpu_tables[MAX_CPUS];
 struct idt_entry_struct idt_entries[256];
 struct idt_ptr_struct   idt_ptr;
-struct tss_entry_struct tss_entry;
 
 extern isr_t interrupt_handlers[];
 
+/* Defined in isr.c */
+extern void double_fault_handler(void);
+
+/* Defined in interrupt.s */
+extern void sysenter_entry(void);
+
+/* MSRs used by the sysenter instruction. */
+#define MSR_SYSENTER_CS     0x174
+#define MSR_SYSENTER_ESP    0x175
+#define MSR_SYSENTER_EIP    0x176
+
+#define CPUID_EDX_SEP       (1 << 11)
+
+/* Page directory loaded by the double fault handler. */
+static u32int double_fault_cr3 = 0;
+
 /*
  * These extern directives let us access the addresses of our ASM ISR handlers.
  */
@@ -216,6 +257,9 @@ extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
 extern void isr128(void);
+extern void isr129(void);
+extern void irq16(void);
+extern void isr255(void);
 
 /*
  * Initialization routine zeroes all the interrupt service routines,
@@ -223,44 +267,68 @@ extern void isr128(void);
  */
 void init_descriptor_tables(void)
 {
-    init_gdt();
+    init_gdt(0);
     init_idt();
     memset(&interrupt_handlers, 0, sizeof (isr_t) * 256);
 }
 
-static void init_gdt(void)
+void init_ap_descriptor_tables(u32int cpu)
 {
-    gdt_ptr.limit = (sizeof gdt_entries) - 1;
-    gdt_ptr.base  = (u32int) &gdt_entries;
+    init_gdt(cpu);
+    idt_flush((u32int) &idt_ptr);
+}
 
-    gdt_set_gate(0, 0, 0, 0, 0);                /* Null segment */
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); /* Code segment */
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); /* Data segment */
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); /* User mode code segment */
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); /* User mode data segment */
-    write_tss(5, 0x10, 0x0);
+u32int cpu_index(void)
+{
+    u32int index = 0;
+    asm volatile ("lsl %1, %0" : "+r" (index) : "r" (GDT_CPU_SELECTOR));
+    return index;
+}
 
-    gdt_flush((u32int) &gdt_ptr);
+static void init_gdt(u32int cpu)
+{
+    struct cpu_tables *tables = &cpu_tables[cpu];
+    struct gdt_entry_struct *gdt = tables->gdt_entries;
+
+    tables->gdt_ptr.limit = (sizeof tables->gdt_entries) - 1;
+    tables->gdt_ptr.base  = (u32int) gdt;
+
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);                /* Null segment */
+    gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF); /* Code segment */
+    gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); /* Data segment */
+    gdt_set_gate(gdt, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF); /* User mode code segment */
+    gdt_set_gate(gdt, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); /* User mode data segment */
+    write_tss(tables, 5, 0x10, 0x0);
+    /* Processor index segment. It is never loaded, only its limit is read
+     * by cpu_index(). */
+    gdt_set_gate(gdt, 6, 0, cpu, 0xF2, 0x40);
+    write_df_tss(tables, 7);
+
+    gdt_flush((u32int) &tables->gdt_ptr);
     tss_flush();
+    init_sysenter(tables);
 }
 
 /*
  * Initialise our task state segment structure.
  */
-static void write_tss(s32int num, u16int ss0, u32int esp0)
+static void write_tss(struct cpu_tables *tables, s32int num,
+                      u16int ss0, u32int esp0)
 {
+    struct tss_entry_struct *tss_entry = &tables->tss_entry;
+
     /* First, let's compute the base and limit of our entry into the GDT. */
-    u32int base  = (u32int) &tss_entry;
-    u32int limit = base + sizeof(tss_entry);
+    u32int base  = (u32int) tss_entry;
+    u32int limit = base + sizeof(*tss_entry);
 
     /* Now, add our TSS descriptor's address to the GDT. */
-    gdt_set_gate(num, base, limit, 0xE9, 0x00);
+    gdt_set_gate(tables->gdt_entries, num, base, limit, 0xE9, 0x00);
 
     /* Ensure the descriptor is initially zero. */
-    memset(&tss_entry, 0, sizeof(tss_entry));
+    memset(tss_entry, 0, sizeof(*tss_entry));
 
-    tss_entry.ss0  = ss0;       /* Set the kernel stack segment. */
-    tss_entry.esp0 = esp0;      /* Set the kernel stack pointer. */
+    tss_entry->ss0  = ss0;      /* Set the kernel stack segment. */
+    tss_entry->esp0 = esp0;     /* Set the kernel stack pointer. */
 
     /* Here we set the cs, ss, ds, es, fs and gs entries in the TSS. These
      * specify what segments should be loaded when the processor switches
@@ -269,34 +337,93 @@ static void write_tss(s32int num, u16int ss0, u32int esp0)
      * set, making 0x0B and 0x13. The settings of htese bits sets the RPL
      * (Requested Privilege Level) to 3, meaning that this TSS can be used
      * to switch to kernel mode from ring 3. */
-    tss_entry.cs = 0x0b;
-    tss_entry.ss = tss_entry.ds =
-        tss_entry.es = tss_entry.fs = tss_entry.gs = 0x13;
+    tss_entry->cs = 0x0b;
+    tss_entry->ss = tss_entry->ds =
+        tss_entry->es = tss_entry->fs = tss_entry->gs = 0x13;
+}
+
+/*
+ * Initialise the task state segment used for double faults. The processor
+ * switches to it through a task gate, loading all registers from it.
+ */
+static void write_df_tss(struct cpu_tables *tables, s32int num)
+{
+    struct tss_entry_struct *tss = &tables->df_tss;
+    u32int base = (u32int) tss;
+
+    gdt_set_gate(tables->gdt_entries, num, base, base + sizeof(*tss),
+                 0x89, 0x00);
+    memset(tss, 0, sizeof(*tss));
+
+    tss->eip    = (u32int) &double_fault_handler;
+    tss->esp    = tss->esp0 = (u32int) tables->df_stack + sizeof(tables->df_stack);
+    tss->ss     = tss->ss0 = tss->ds = tss->es = tss->fs = tss->gs = 0x10;
+    tss->cs     = 0x08;
+    tss->eflags = 0x2;  /* Interrupts disabled. */
+    tss->cr3    = double_fault_cr3;
+}
+
+int sysenter_present(void)
+{
+    u32int eax, edx;
+    cpuid(1, &eax, 0, 0, &edx);
+    if (!(edx & CPUID_EDX_SEP))
+        return 0;
+    /* Early Pentium Pro processors report the flag without having the
+     * instructions. */
+    u32int family = (eax >> 8) & 0xF, model = (eax >> 4) & 0xF;
+    return !(family == 6 && model < 3 && (eax & 0xF) < 3);
+}
+
+/*
+ * Point the sysenter instruction at the kernel entry. The stack pointer it
+ * loads is the address of the TSS, the entry code then switches to the
+ * kernel stack stored in its esp0 field. That way set_kernel_stack() is all
+ * it takes to change the stack of both entry paths.
+ */
+static void init_sysenter(struct cpu_tables *tables)
+{
+    if (!sysenter_present())
+        return;
+    /* sysexit derives the user selectors from this one: code at +16 and
+     * stack at +24, which matches the order in the GDT. */
+    wrmsr(MSR_SYSENTER_CS, 0x08);
+    wrmsr(MSR_SYSENTER_ESP, (u32int) &tables->tss_entry);
+    wrmsr(MSR_SYSENTER_EIP, (u32int) &sysenter_entry);
+}
+
+void set_double_fault_cr3(u32int cr3)
+{
+    double_fault_cr3 = cr3;
+    u32int i;
+    for (i = 0; i < MAX_CPUS; ++i)
+        cpu_tables[i].df_tss.cr3 = cr3;
 }
 
 void set_kernel_stack(u32int stack)
 {
-    tss_entry.esp0 = stack;
+    cpu_tables[cpu_index()].tss_entry.esp0 = stack;
 }
 
 /*
  * Set the value of one GDT entry.
  */
-static void gdt_set_gate(s32int num,
+static void gdt_set_gate(struct gdt_entry_struct *gdt,
+                         s32int num,
                          u32int base,
                          u32int limit,
                          u8int access,
                          u8int gran)
 {
-    gdt_entries[num].base_low    = (base & 0xFFFF);
-    gdt_entries[num].base_middle = (base >> 16) & 0xFF;
-    gdt_entries[num].base_high   = (base >> 24) & 0xFF;
+    gdt[num].base_low    = (base & 0xFFFF);
+    gdt[num].base_middle = (base >> 16) & 0xFF;
+    gdt[num].base_high   = (base >> 24) & 0xFF;
 
-    gdt_entries[num].limit_low   = (limit & 0xFFFF);
-    gdt_entries[num].granularity = (limit >> 16) & 0x0F;
+    gdt[num].limit_low   = (limit & 0xFFFF);
+    gdt[num].granularity = (limit >> 16) & 0x0F;
 
-    gdt_entries[num].granularity |= gran & 0xF0;
-    gdt_entries[num].access      = access;
+    gdt[num].granularity |= gran & 0xF0;
+    gdt[num].access      = access;
 }
 
 static void init_idt(void)
@@ -326,7 +453,9 @@ static void init_idt(void)
     idt_set_gate( 5, (u32int) isr5,  0x08, 0x8E);
     idt_set_gate( 6, (u32int) isr6,  0x08, 0x8E);
     idt_set_gate( 7, (u32int) isr7,  0x08, 0x8E);
-    idt_set_gate( 8, (u32int) isr8,  0x08, 0x8E);
+    /* Double fault goes through a task gate, see write_df_tss(). */
+    idt_entries[8].sel   = DOUBLE_FAULT_TSS;
+    idt_entries[8].flags = 0x85;
     idt_set_gate( 9, (u32int) isr9,  0x08, 0x8E);
     idt_set_gate(10, (u32int) isr10, 0x08, 0x8E);
     idt_set_gate(11, (u32int) isr11, 0x08, 0x8E);
@@ -367,7 +496,11 @@ static void init_idt(void)
     idt_set_gate(45, (u32int) irq13, 0x08, 0x8E);
     idt_set_gate(46, (u32int) irq14, 0x08, 0x8E);
     idt_set_gate(47, (u32int) irq15, 0x08, 0x8E);
-    idt_set_gate(128, (u32int) isr128, 0x08, 0x8E);
+    idt_set_gate(48, (u32int) irq16, 0x08, 0x8E);
+    /* The system call gate must be reachable from ring 3. */
+    idt_set_gate(128, (u32int) isr128, 0x08, 0xEE);
+    idt_set_gate(NULL_VECTOR, (u32int) isr129, 0x08, 0x8E);
+    idt_set_gate(255, (u32int) isr255, 0x08, 0x8E);
 
     idt_flush((u32int) &idt_ptr);
 }
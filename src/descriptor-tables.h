@@ -11,13 +11,49 @@
 
 #include "common.h"
 
+/** Selector of the segment whose limit holds the processor index. */
+#define GDT_CPU_SELECTOR    0x33
+
 /**
  * Initialisation function is publicly accessible.
  */
 void init_descriptor_tables(void);
 
 /**
- * Set kernel stack pointer.
+ * Load descriptor tables on an application processor. Each processor has
+ * its own GDT and TSS, the IDT is shared.
+ *
+ * @param cpu   index of the processor
+ */
+void init_ap_descriptor_tables(u32int cpu);
+
+/**
+ * Get index of the executing processor. The index is read from the limit
+ * of the #GDT_CPU_SELECTOR segment in the processor's own GDT.
+ *
+ * @return index of the processor, 0 for the bootstrap processor
+ */
+u32int cpu_index(void);
+
+/**
+ * Check whether the processor has the sysenter and sysexit instructions.
+ * When it does, init_descriptor_tables() and init_ap_descriptor_tables()
+ * set up sysenter to enter the system call dispatcher.
+ *
+ * @return nonzero if the instructions may be used
+ */
+int sysenter_present(void);
+
+/**
+ * Set the page directory the double fault handler runs with. Any directory
+ * mapping the kernel will do.
+ *
+ * @param cr3   physical address of the directory
+ */
+void set_double_fault_cr3(u32int cr3);
+
+/**
+ * Set kernel stack pointer of the executing processor.
  *
  * @param stack new value for kernel stack pointer (esp)
  */
@@ -26,6 +26,37 @@ u32int write_fs(fs_node_t *node, u32int offset, u32int size, u8int *buffer)
         return 0;
 }
 
+u32int readv_fs(fs_node_t *node, u32int offset, iovec_t *iov, u32int iovcnt)
+{
+    if (node->readv)
+        return node->readv(node, offset, iov, iovcnt);
+
+    /* Transfer one buffer at a time, until one comes back short. */
+    u32int total = 0, i;
+    for (i = 0; i < iovcnt; ++i) {
+        u32int n = read_fs(node, offset + total, iov[i].len, iov[i].base);
+        total += n;
+        if (n < iov[i].len)
+            break;
+    }
+    return total;
+}
+
+u32int writev_fs(fs_node_t *node, u32int offset, iovec_t *iov, u32int iovcnt)
+{
+    if (node->writev)
+        return node->writev(node, offset, iov, iovcnt);
+
+    u32int total = 0, i;
+    for (i = 0; i < iovcnt; ++i) {
+        u32int n = write_fs(node, offset + total, iov[i].len, iov[i].base);
+        total += n;
+        if (n < iov[i].len)
+            break;
+    }
+    return total;
+}
+
 void open_fs(fs_node_t *node, u8int read, u8int write)
 {
     if (node->open)
@@ -53,3 +84,27 @@ fs_node_t *finddir_fs(fs_node_t *node, char *name)
     else
         return 0;
 }
+
+fs_node_t *lookup_fs(fs_node_t *node, const char *path)
+{
+    char name[sizeof(((struct dirent *) 0)->name)];
+
+    while (node) {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            return node;
+
+        u32int len = 0;
+        while (path[len] && path[len] != '/') {
+            if (len == sizeof(name) - 1)
+                return 0;
+            name[len] = path[len];
+            len++;
+        }
+        name[len] = 0;
+        path += len;
+        node = finddir_fs(node, name);
+    }
+    return 0;
+}
@@ -19,10 +19,23 @@
 #define FS_SYMLINK      0x06    /**< Whether node is a symbolic link */
 #define FS_MOUNTPOINT   0x08    /**< Whether node is an active mountpoint? */
 
+/** Largest number of buffers in one vectored transfer. */
+#define IOV_MAX         16
+
 struct fs_node;
 
+/** One buffer of a vectored transfer. */
+typedef struct {
+    /** Start of the buffer. */
+    void *base;
+    /** Length of the buffer in bytes. */
+    u32int len;
+} iovec_t;
+
 typedef u32int (*read_type_t)   (struct fs_node*, u32int, u32int, u8int*);
 typedef u32int (*write_type_t)  (struct fs_node*, u32int, u32int, u8int*);
+typedef u32int (*readv_type_t)  (struct fs_node*, u32int, iovec_t*, u32int);
+typedef u32int (*writev_type_t) (struct fs_node*, u32int, iovec_t*, u32int);
 typedef void   (*open_type_t)   (struct fs_node*);
 typedef void   (*close_type_t)  (struct fs_node*);
 typedef struct dirent * (*readdir_type_t) (struct fs_node*, u32int);
@@ -53,6 +66,10 @@ typedef struct fs_node {
     close_type_t    close;
     readdir_type_t  readdir;
     finddir_type_t  finddir;
+    /** Optional, read_fs() is called for each buffer when missing. */
+    readv_type_t    readv;
+    /** Optional, write_fs() is called for each buffer when missing. */
+    writev_type_t   writev;
 
     /** Used by mountpoints and symlinks. */
     struct fs_node *ptr;
@@ -80,8 +97,42 @@ extern fs_node_t *fs_root;
 u32int read_fs(fs_node_t *node, u32int offset, u32int size, u8int *buffer);
 u32int write_fs(fs_node_t *node, u32int offset, u32int size, u8int *buffer);
 void open_fs(fs_node_t *node, u8int read, u8int write);
+
+/**
+ * Read consecutive bytes of a file into several buffers, filling each
+ * before the next one.
+ *
+ * @param node      file to read
+ * @param offset    offset in the file of the first byte
+ * @param iov       buffers to fill
+ * @param iovcnt    number of buffers
+ * @return number of bytes read, less than requested at the end of file
+ */
+u32int readv_fs(fs_node_t *node, u32int offset, iovec_t *iov, u32int iovcnt);
+
+/**
+ * Write several buffers to consecutive bytes of a file.
+ *
+ * @param node      file to write
+ * @param offset    offset in the file of the first byte
+ * @param iov       buffers to write
+ * @param iovcnt    number of buffers
+ * @return number of bytes written
+ */
+u32int writev_fs(fs_node_t *node, u32int offset, iovec_t *iov, u32int iovcnt);
+
 void close_fs(fs_node_t *node);
 struct dirent * readdir_fs(fs_node_t *node, u32int index);
 fs_node_t *finddir_fs(fs_node_t *node, char *name);
 
+/**
+ * Find a node by its path, one component at a time. Components are
+ * separated by slashes, empty ones are skipped.
+ *
+ * @param node  directory the path starts from
+ * @param path  path of the node, relative to node
+ * @return the node, or null if some component does not exist
+ */
+fs_node_t *lookup_fs(fs_node_t *node, const char *path);
+
 #endif /* end of include guard: FS_H */
@@ -7,6 +7,8 @@
 
 #include "initrd.h"
 #include "kheap.h"
+#include "monitor.h"
+#include "spinlock.h"
 
 /** Header of initial ramdisk. */
 typedef struct {
@@ -25,45 +27,300 @@ typedef struct {
     u32int length;
 } initrd_file_header_t;
 
+/** Header of a version 2 ramdisk. All offsets are from its start. */
+typedef struct {
+    /** Always INITRD2_MAGIC. */
+    u32int magic;
+    /** Always 2. */
+    u32int version;
+    /** Number of entries, the first is the root directory. */
+    u32int nentries;
+    /** Offset of the entry table. */
+    u32int entries;
+    /** Offset of the hash table of the names, zero if there is none. The
+     * names follow it directly. */
+    u32int hash;
+    /** Offset of the null terminated names. */
+    u32int names;
+    /** Size of the whole ramdisk. */
+    u32int size;
+    /** Reserved, zero. */
+    u32int reserved;
+} initrd2_header_t;
+
+/** Entry of a version 2 ramdisk. The children of a directory are
+ * consecutive entries. */
+typedef struct {
+    /** Offset of the name in the names. */
+    u32int name;
+    /** INITRD2_FILE or INITRD2_DIR, a file may also have INITRD2_LZ4. */
+    u32int flags;
+    /** File: page aligned offset of the data. Directory: index of the
+     * first child. */
+    u32int offset;
+    /** File: length in bytes, uncompressed. Directory: number of
+     * children. */
+    u32int length;
+    /** CRC-32 of the data of a file, as stored. */
+    u32int crc;
+} initrd2_entry_t;
+
+#define INITRD2_MAGIC   0x32445249  /* "IRD2" */
+#define INITRD2_FILE    1
+#define INITRD2_DIR     2
+/* The file is split in blocks of INITRD2_BLOCK_SIZE bytes, compressed one
+ * by one with LZ4. The data starts with the offsets of the blocks from the
+ * start of the data, one more than there are blocks, the last one giving
+ * the size of the data. A block as long as its uncompressed size is stored
+ * as is. */
+#define INITRD2_LZ4     4
+
+#define INITRD2_BLOCK_SIZE  0x1000
+
+/* Number of decompressed blocks kept. */
+#define INITRD_CACHE_BLOCKS 8
+
+/* Name of the entry gen-initrd stores the hash table of the file names
+ * in, in version 1. It is always the last one and not shown as a file. */
+#define HASH_NAME   ".hash"
 
-/* The header. */
-initrd_header_t *initrd_header;
-/* The list of file headers. */
-initrd_file_header_t *file_headers;
 /* Our root directory node. */
 fs_node_t *initrd_root;
 /* We also add a directory node for /dev, so we can mount devfs later on. */
 fs_node_t *initrd_dev;
-/* List of file nodes. */
-fs_node_t *root_nodes;
+/* Nodes of all entries. A directory holds the index of its first child in
+ * impl and the number of children in length, a file the address of its
+ * data in impl. */
+fs_node_t *initrd_nodes;
+static u32int initrd_nnodes;
+/* Memory of the module the ramdisk was loaded from, until it is released. */
+static u32int module_start, module_end;
 
 struct dirent dirent;
 
+/* Hash table of the names, if the ramdisk has one: the number of buckets,
+ * the buckets, the chain links and the hashes. Buckets and chain links hold
+ * the index of an entry plus one, zero ends a chain. */
+static u32int *hash_table;
+static u32int hash_size;
+static u32int hash_mask;
+static u32int *hash_buckets;
+static u32int *hash_next;
+static u32int *hash_values;
+
+/* Decompressed blocks of compressed files, allocated with the first such
+ * file. */
+typedef struct {
+    /* Data of the file, zero if the entry is unused. */
+    u32int file;
+    u32int block;
+    /* Value of cache_clock at the last use, for evicting the oldest. */
+    u32int used;
+    u8int data[INITRD2_BLOCK_SIZE];
+} initrd_block_t;
+
+static initrd_block_t *block_cache;
+static u32int cache_clock;
+static spinlock_t cache_lock;
+
+/*
+ * FNV-1a hash of a file name, must match hash_name() in gen-initrd.
+ */
+static u32int initrd_hash(const char *name)
+{
+    u32int h = 2166136261u;
+    while (*name) {
+        h ^= (u8int) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Use a hash table as stored by gen-initrd for n entries, if it is well
+ * formed. Every link of a chain points to a lower entry, so chains end.
+ */
+static void initrd_load_hash(u32int *table, u32int size, u32int n)
+{
+    if (size < sizeof(u32int))
+        return;
+    u32int nbuckets = table[0];
+    if (!nbuckets || nbuckets & (nbuckets - 1) ||
+            size != (1 + nbuckets + 2 * (u64int) n) * sizeof(u32int))
+        return;
+
+    u32int i;
+    for (i = 0; i < nbuckets; ++i) {
+        if (table[1 + i] > n)
+            return;
+    }
+    for (i = 0; i < n; ++i) {
+        if (table[1 + nbuckets + i] > i)
+            return;
+    }
+
+    hash_table = table;
+    hash_size = size;
+    hash_mask = nbuckets - 1;
+    hash_buckets = table + 1;
+    hash_next = hash_buckets + nbuckets;
+    hash_values = hash_next + n;
+}
+
 static u32int initrd_read(fs_node_t *node,
         u32int offset, u32int size, u8int *buffer)
 {
-    initrd_file_header_t header = file_headers[node->inode];
-    if (offset > header.length)
+    if (offset > node->length)
         return 0;
-    if (offset + size > header.length)
-        size = header.length - offset;
-    memcpy(buffer, (u8int *) (header.offset + offset), size);
+    if (offset + size > node->length)
+        size = node->length - offset;
+    memcpy(buffer, (u8int *) (node->impl + offset), size);
     return size;
 }
 
+/*
+ * Decompress an LZ4 block of srclen bytes into dst, which holds dstlen
+ * bytes. Returns the number of bytes produced, which is less than dstlen if
+ * the block is malformed.
+ */
+static u32int lz4_decompress(const u8int *src, u32int srclen,
+        u8int *dst, u32int dstlen)
+{
+    const u8int *end = src + srclen;
+    u32int out = 0, len, dist;
+    u8int b;
+
+    while (src < end) {
+        u32int token = *src++;
+
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (src == end)
+                    return out;
+                b = *src++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (u32int) (end - src) || len > dstlen - out)
+            return out;
+        memcpy(dst + out, src, len);
+        src += len;
+        out += len;
+
+        /* The last sequence has no match. */
+        if (src == end)
+            break;
+        if (end - src < 2)
+            return out;
+        dist = src[0] | src[1] << 8;
+        src += 2;
+        if (!dist || dist > out)
+            return out;
+
+        len = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            do {
+                if (src == end)
+                    return out;
+                b = *src++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > dstlen - out)
+            return out;
+        /* The match may overlap the bytes it produces. */
+        for (; len; --len, ++out)
+            dst[out] = dst[out - dist];
+    }
+    return out;
+}
+
+/*
+ * Get a block of a compressed file from the cache, decompressing it in
+ * place of the least recently used one if it is not there. Called with
+ * cache_lock held.
+ */
+static u8int *initrd_block(fs_node_t *node, u32int block)
+{
+    initrd_block_t *victim = &block_cache[0];
+    u32int i;
+    for (i = 0; i < INITRD_CACHE_BLOCKS; ++i) {
+        initrd_block_t *b = &block_cache[i];
+        if (b->file == node->impl && b->block == block) {
+            b->used = ++cache_clock;
+            return b->data;
+        }
+        if (b->used < victim->used)
+            victim = b;
+    }
+
+    u32int *index = (u32int *) node->impl;
+    u8int *src = (u8int *) (node->impl + index[block]);
+    u32int srclen = index[block + 1] - index[block];
+    u32int len = node->length - block * INITRD2_BLOCK_SIZE;
+    if (len > INITRD2_BLOCK_SIZE)
+        len = INITRD2_BLOCK_SIZE;
+
+    victim->file = 0;
+    victim->used = 0;
+    if (srclen == len)
+        memcpy(victim->data, src, len);
+    else if (lz4_decompress(src, srclen, victim->data, len) != len)
+        return 0;
+    victim->file  = node->impl;
+    victim->block = block;
+    victim->used  = ++cache_clock;
+    return victim->data;
+}
+
+/*
+ * Read a compressed file, decompressing only the blocks the range covers.
+ */
+static u32int initrd_read_lz4(fs_node_t *node,
+        u32int offset, u32int size, u8int *buffer)
+{
+    if (offset > node->length)
+        return 0;
+    if (offset + size > node->length)
+        size = node->length - offset;
+
+    u32int done = 0;
+    u32int flags = spin_lock_irqsave(&cache_lock);
+    while (done < size) {
+        u32int pos = offset + done;
+        u8int *block = initrd_block(node, pos / INITRD2_BLOCK_SIZE);
+        if (!block)
+            break;
+
+        u32int start = pos % INITRD2_BLOCK_SIZE;
+        u32int n = INITRD2_BLOCK_SIZE - start;
+        if (n > size - done)
+            n = size - done;
+        memcpy(buffer + done, block + start, n);
+        done += n;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    return done;
+}
+
 static struct dirent *initrd_readdir(fs_node_t *node, u32int index)
 {
-    if (node == initrd_root && index == 0) {
-        strcpy(dirent.name, "dev");
-        dirent.ino = 0;
-        return &dirent;
+    if (node == initrd_root) {
+        if (index == 0) {
+            strcpy(dirent.name, "dev");
+            dirent.ino = 0;
+            return &dirent;
+        }
+        index--;
     }
 
-    if (index - 1 >= initrd_header->nfiles)
+    if (index >= node->length)
         return 0;
 
-    strcpy(dirent.name, root_nodes[index-1].name);
-    dirent.ino = root_nodes[index-1].inode;
+    fs_node_t *child = &initrd_nodes[node->impl + index];
+    strcpy(dirent.name, child->name);
+    dirent.ino = child->inode;
     return &dirent;
 }
 
@@ -73,72 +330,281 @@ static fs_node_t *initrd_finddir(fs_node_t *node, char *name)
         return initrd_dev;
 
     u32int i;
-    for (i = 0; i < initrd_header->nfiles; ++i) {
-        if (!strcmp(name, root_nodes[i].name))
-            return &root_nodes[i];
+    if (hash_buckets) {
+        /* The children of the directory are the entries between first and
+         * end. */
+        u32int h = initrd_hash(name);
+        u32int first = node->impl + 1, end = first + node->length;
+        for (i = hash_buckets[h & hash_mask]; i; i = hash_next[i - 1]) {
+            if (hash_values[i - 1] == h && i >= first && i < end
+                    && !strcmp(name, initrd_nodes[i - 1].name))
+                return &initrd_nodes[i - 1];
+        }
+        return 0;
+    }
+
+    for (i = 0; i < node->length; ++i) {
+        if (!strcmp(name, initrd_nodes[node->impl + i].name))
+            return &initrd_nodes[node->impl + i];
     }
     return 0;
 }
 
-fs_node_t *initialise_initrd(u32int location)
+/*
+ * Initialise a node of the ramdisk. Names too long for the node are cut.
+ */
+static void init_node(fs_node_t *node, const char *name, u32int flags,
+                      u32int inode)
 {
-    /* Initialise the main and file header pointers. */
-    initrd_header = (initrd_header_t *) location;
-    file_headers = (initrd_file_header_t *) (location + sizeof(initrd_header_t));
+    u32int i;
+    for (i = 0; i < sizeof(node->name) - 1 && name[i]; ++i)
+        node->name[i] = name[i];
+    node->name[i] = 0;
+    node->mask = node->uid = node->gid = 0;
+    node->inode   = inode;
+    node->length  = 0;
+    node->flags   = flags;
+    node->read    = flags == FS_FILE ? &initrd_read : 0;
+    node->write   = 0;
+    node->open    = 0;
+    node->close   = 0;
+    node->readdir = flags == FS_DIRECTORY ? &initrd_readdir : 0;
+    node->finddir = flags == FS_DIRECTORY ? &initrd_finddir : 0;
+    node->readv   = 0;
+    node->writev  = 0;
+    node->ptr     = 0;
+    node->impl    = 0;
+}
+
+/*
+ * Read the original format: a count and 64 file headers, all files in the
+ * root directory.
+ */
+static void initrd_load_v1(u32int location)
+{
+    initrd_header_t *header = (initrd_header_t *) location;
+    initrd_file_header_t *files =
+        (initrd_file_header_t *) (location + sizeof(initrd_header_t));
+    u32int nfiles = header->nfiles;
+
+    /* Hide the hash table from readdir. */
+    if (nfiles && !strcmp((char *) files[nfiles - 1].name, HASH_NAME)) {
+        nfiles--;
+        initrd_load_hash((u32int *) (location + files[nfiles].offset),
+                         files[nfiles].length, nfiles);
+    }
 
-    /* Initialise the root directory. */
     initrd_root = kmalloc(sizeof(fs_node_t));
+    init_node(initrd_root, "initrd", FS_DIRECTORY, 0);
+    initrd_root->length = nfiles;
+
+    initrd_nodes = kmalloc(sizeof(fs_node_t) * nfiles);
+    initrd_nnodes = nfiles;
+    module_end = location + sizeof(initrd_header_t) +
+                 64 * sizeof(initrd_file_header_t);
+    u32int i;
+    for (i = 0; i < header->nfiles; ++i) {
+        if (location + files[i].offset + files[i].length > module_end)
+            module_end = location + files[i].offset + files[i].length;
+        if (i >= nfiles)
+            continue;
+        init_node(&initrd_nodes[i], (char *) files[i].name, FS_FILE, i);
+        initrd_nodes[i].length = files[i].length;
+        initrd_nodes[i].impl   = location + files[i].offset;
+    }
+}
+
+/*
+ * Size of the data of a compressed file as stored, from its block index,
+ * or zero if the index does not fit in the ramdisk or its blocks are not
+ * in order after it.
+ */
+static u32int lz4_stored_size(u32int data, u32int length, u32int avail)
+{
+    u32int nblocks = length / INITRD2_BLOCK_SIZE +
+                     (length % INITRD2_BLOCK_SIZE != 0);
+    u32int *index = (u32int *) data;
+    if ((nblocks + 1) * sizeof(u32int) > avail || index[nblocks] > avail)
+        return 0;
+
+    u32int i;
+    if (index[0] < (nblocks + 1) * sizeof(u32int))
+        return 0;
+    for (i = 0; i < nblocks; ++i) {
+        if (index[i] > index[i + 1])
+            return 0;
+    }
+    return index[nblocks];
+}
+
+/*
+ * Check that an entry of a version 2 ramdisk only refers to memory of the
+ * ramdisk: its name must be terminated before the end, the children of a
+ * directory must be entries, and the data of a file must fit. The block
+ * index of a compressed file is checked by lz4_stored_size().
+ */
+static int initrd_entry_ok(u32int location, initrd2_entry_t *e)
+{
+    initrd2_header_t *header = (initrd2_header_t *) location;
+    const char *names = (const char *) (location + header->names);
+    u32int avail = header->size - header->names;
+    u32int i;
+
+    for (i = e->name; i < avail && names[i]; ++i)
+        ;
+    if (i >= avail)
+        return 0;
+
+    if (e->flags & INITRD2_DIR)
+        return e->offset <= header->nentries &&
+               e->length <= header->nentries - e->offset;
+    if (e->offset > header->size)
+        return 0;
+    return (e->flags & INITRD2_LZ4) || e->length <= header->size - e->offset;
+}
+
+/*
+ * Check that the tables of a version 2 ramdisk lie within it, in the order
+ * gen-initrd writes them, and that the root is a valid directory.
+ */
+static int initrd_header_ok(u32int location)
+{
+    initrd2_header_t *header = (initrd2_header_t *) location;
+    u32int size = header->size;
+
+    if (size < sizeof(initrd2_header_t) || header->entries > size ||
+            header->names > size || !header->nentries ||
+            header->nentries > (size - header->entries) /
+                               sizeof(initrd2_entry_t))
+        return 0;
+    if (header->hash && (header->hash < sizeof(initrd2_header_t) ||
+                         header->hash > header->names))
+        return 0;
+
+    initrd2_entry_t *root = (initrd2_entry_t *) (location + header->entries);
+    return (root->flags & INITRD2_DIR) && initrd_entry_ok(location, root);
+}
+
+/*
+ * Read a version 2 ramdisk. Entries pointing out of the ramdisk and files
+ * whose checksum does not match are left empty.
+ */
+static void initrd_load_v2(u32int location)
+{
+    initrd2_header_t *header = (initrd2_header_t *) location;
+    if (!initrd_header_ok(location))
+        PANIC("initrd: bad header");
+
+    initrd2_entry_t *entries =
+        (initrd2_entry_t *) (location + header->entries);
+    const char *names = (const char *) (location + header->names);
+    u32int n = header->nentries;
+
+    if (header->hash)
+        initrd_load_hash((u32int *) (location + header->hash),
+                         header->names - header->hash, n);
+
+    initrd_nodes = kmalloc(sizeof(fs_node_t) * n);
+    initrd_nnodes = n;
+    module_end = location + header->size;
+    u32int i;
+    for (i = 0; i < n; ++i) {
+        initrd2_entry_t *e = &entries[i];
+        fs_node_t *node = &initrd_nodes[i];
+        if (!initrd_entry_ok(location, e)) {
+            init_node(node, "", e->flags & INITRD2_DIR ? FS_DIRECTORY
+                                                       : FS_FILE, i);
+            monitor_print("initrd: entry %u is corrupted\n", i);
+            continue;
+        }
+        if (e->flags & INITRD2_DIR) {
+            init_node(node, names + e->name, FS_DIRECTORY, i);
+            node->impl   = e->offset;
+            node->length = e->length;
+            continue;
+        }
+
+        init_node(node, names + e->name, FS_FILE, i);
+        u32int stored = e->length;
+        if (e->flags & INITRD2_LZ4)
+            stored = lz4_stored_size(location + e->offset, e->length,
+                                     header->size - e->offset);
+        if ((e->length && !stored) ||
+                crc32((u8int *) (location + e->offset), stored) != e->crc) {
+            monitor_print("initrd: %s is corrupted\n", node->name);
+            continue;
+        }
+        node->impl   = location + e->offset;
+        node->length = e->length;
+
+        if (e->flags & INITRD2_LZ4) {
+            node->read = &initrd_read_lz4;
+            if (!block_cache) {
+                block_cache = kmalloc(sizeof(initrd_block_t) *
+                                      INITRD_CACHE_BLOCKS);
+                memset(block_cache, 0,
+                       sizeof(initrd_block_t) * INITRD_CACHE_BLOCKS);
+                spin_init(&cache_lock, "initrd");
+            }
+        }
+    }
+
+    initrd_root = &initrd_nodes[0];
     strcpy(initrd_root->name, "initrd");
-    initrd_root->mask = initrd_root->uid = initrd_root->gid =
-        initrd_root->inode = initrd_root->length = 0;
-    initrd_root->flags   = FS_DIRECTORY;
-    initrd_root->read    = 0;
-    initrd_root->write   = 0;
-    initrd_root->open    = 0;
-    initrd_root->close   = 0;
-    initrd_root->readdir = &initrd_readdir;
-    initrd_root->finddir = &initrd_finddir;
-    initrd_root->ptr     = 0;
-    initrd_root->impl    = 0;
+}
+
+fs_node_t *initialise_initrd(u32int location)
+{
+    module_start = location;
+    if (*(u32int *) location == INITRD2_MAGIC &&
+            ((initrd2_header_t *) location)->version == 2)
+        initrd_load_v2(location);
+    else
+        initrd_load_v1(location);
 
     /* Initialise the /dev directory. */
     initrd_dev = kmalloc(sizeof(fs_node_t));
-    strcpy(initrd_dev->name, "dev");
-    initrd_dev->mask = initrd_dev->uid = initrd_dev->gid =
-        initrd_dev->inode = initrd_dev->length = 0;
-    initrd_dev->flags   = FS_DIRECTORY;
-    initrd_dev->read    = 0;
-    initrd_dev->write   = 0;
-    initrd_dev->open    = 0;
-    initrd_dev->close   = 0;
-    initrd_dev->readdir = &initrd_readdir;
-    initrd_dev->finddir = &initrd_finddir;
-    initrd_dev->ptr     = 0;
-    initrd_dev->impl    = 0;
-
-    root_nodes = kmalloc(sizeof(fs_node_t) * initrd_header->nfiles);
+    init_node(initrd_dev, "dev", FS_DIRECTORY, 0);
+
+    return initrd_root;
+}
 
+void initrd_keep(fs_node_t *node)
+{
+    if (node->read != &initrd_read && node->read != &initrd_read_lz4)
+        return;
+    if (node->impl < module_start || node->impl >= module_end)
+        return;
+
+    /* Compressed files are unpacked on the way. */
+    u8int *copy = kmalloc(node->length ? node->length : 1);
+    read_fs(node, 0, node->length, copy);
+    node->impl = (u32int) copy;
+    node->read = &initrd_read;
+}
+
+void initrd_release(void)
+{
     u32int i;
-    for (i = 0; i < initrd_header->nfiles; ++i) {
-        /* Edit the file's header - currently it holds the file offset
-         * relative to the start of the ramdisk. We want it to be relative
-         * to the start of memory. */
-        file_headers[i].offset += location;
-        /* Create a new file_node. */
-        strcpy(root_nodes[i].name, (char *) &file_headers[i].name);
-        root_nodes[i].mask = root_nodes[i].uid = root_nodes[i].gid = 0;
-        root_nodes[i].inode   = i;
-        root_nodes[i].length  = file_headers[i].length;
-        root_nodes[i].flags   = FS_FILE;
-        root_nodes[i].read    = &initrd_read;
-        root_nodes[i].write   = 0;
-        root_nodes[i].open    = 0;
-        root_nodes[i].close   = 0;
-        root_nodes[i].readdir = 0;
-        root_nodes[i].finddir = 0;
-        root_nodes[i].ptr     = 0;
-        root_nodes[i].impl    = 0;
+    for (i = 0; i < initrd_nnodes; ++i) {
+        fs_node_t *node = &initrd_nodes[i];
+        if (node->flags != FS_FILE || node->impl < module_start ||
+                node->impl >= module_end)
+            continue;
+        node->impl   = 0;
+        node->length = 0;
+        node->read   = &initrd_read;
     }
 
-    return initrd_root;
+    /* The names are in the nodes already, only the hash table is left. */
+    if (hash_table) {
+        u32int *copy = kmalloc(hash_size);
+        memcpy(copy, hash_table, hash_size);
+        initrd_load_hash(copy, hash_size, initrd_nnodes);
+    }
+    if (block_cache) {
+        kfree(block_cache);
+        block_cache = 0;
+    }
+    module_start = module_end = 0;
 }
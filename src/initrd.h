@@ -19,4 +19,19 @@
  */
 fs_node_t *initialise_initrd(u32int location);
 
+/**
+ * Move a file of the ramdisk out of the module into the kernel heap, so
+ * that it survives initrd_release(). Compressed files are decompressed.
+ *
+ * @param node  file to keep
+ */
+void initrd_keep(fs_node_t *node);
+
+/**
+ * Stop using the module the ramdisk was loaded from, so that its memory can
+ * be freed. Files not kept with initrd_keep() become empty, directories
+ * stay as they are.
+ */
+void initrd_release(void);
+
 #endif /* end of include guard: INITRD_H */
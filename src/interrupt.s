@@ -1,7 +1,9 @@
+; All gates are interrupt gates, so the processor has already disabled
+; interrupts when the stubs run, and iret restores the interrupt flag.
+
 %macro ISR_NOERRCODE 1  ; define a macro with one parameter
 [GLOBAL isr%1]          ; 01 accesses the parameter
 isr%1:
-    cli                 ; Disable interrupts
     push byte 0         ; Push a dummy error code
     push %1             ; Push the interrupt number
     jmp isr_common_stub ; Go to our common handler
@@ -10,7 +12,6 @@ isr%1:
 %macro ISR_ERRCODE 1    ; another macro with 1 parameter
 [GLOBAL isr%1]
 isr%1:
-    cli
     push %1
     jmp isr_common_stub
 %endmacro
@@ -20,7 +21,6 @@ isr%1:
 %macro IRQ 2
 [GLOBAL irq%1]
 irq%1:
-    cli
     push byte 0
     push byte %2
     jmp irq_common_stub
@@ -59,6 +59,8 @@ ISR_NOERRCODE 29
 ISR_NOERRCODE 30
 ISR_NOERRCODE 31
 ISR_NOERRCODE 128
+ISR_NOERRCODE 129       ; Null interrupt for measuring the entry path
+ISR_NOERRCODE 255
 IRQ 0,  32
 IRQ 1,  33
 IRQ 2,  34
@@ -75,65 +77,147 @@ IRQ 12, 44
 IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
+IRQ 16, 48              ; Local APIC timer
 
-; in isr.c
-[EXTERN isr_handler]
-
-; This is our common ISR stub. It saves the processor state, sets up for
-; kernel mode segments, calls the C-level fault handler, and finally restores
-; the stack frame.
-isr_common_stub:
-    pusha           ; Pushes edi, esi, ebp, esp, ebx, edx, ecx, eax
-
-    mov ax, ds      ; Lower 16 bits of eax = ds
-    push eax        ; Save the data segment descriptor
+; Offset of the code segment of the interrupted code in registers_t.
+%define REGS_CS 48
 
+; Segment registers only need to be changed when the interrupt came from
+; user mode, the kernel always runs with the kernel data segment.
+%macro KERNEL_SEGMENTS 0
+    test byte [esp+REGS_CS], 3
+    jz %%kernel
     mov ax, 0x10    ; Load the kernel data segment descriptor
     mov ds, ax
     mov es, ax
     mov fs, ax
     mov gs, ax
+%%kernel:
+%endmacro
 
-    call isr_handler
-
-    pop eax         ; reload the original data segment descriptor
+%macro RESTORE_SEGMENTS 0
+    pop eax         ; The original data segment descriptor
+    test byte [esp+REGS_CS-4], 3
+    jz %%kernel
     mov ds, ax
     mov es, ax
     mov fs, ax
     mov gs, ax
+%%kernel:
+%endmacro
+
+; in isr.c
+[EXTERN isr_handler]
 
+; This is our common ISR stub. It saves the processor state, sets up for
+; kernel mode segments, calls the C-level fault handler with a pointer to
+; the saved state, and finally restores the stack frame.
+isr_common_stub:
+    pusha           ; Pushes edi, esi, ebp, esp, ebx, edx, ecx, eax
+
+    mov ax, ds      ; Lower 16 bits of eax = ds
+    push eax        ; Save the data segment descriptor
+    KERNEL_SEGMENTS
+
+    push esp        ; Pointer to the registers_t on the stack
+    call isr_handler
+    add esp, 4
+
+    RESTORE_SEGMENTS
     popa            ; Pops edi, esi, ...
     add esp, 8      ; Cleans up the pushed error code and pushed ISR number
-    sti             ; Enable interrupts
     iret            ; Pops 5 things at once: CS, EIP, EFLAGS, SS and ESP
 
 ; In isr.c
 [EXTERN irq_handler]
 
 ; This is our common IRQ stub. It saves the processor state, sets up for
-; kernel mode segments, calls the C-level fault handler, and finally
-; restores the stack frame.
+; kernel mode segments, calls the C-level IRQ handler with a pointer to the
+; saved state, and finally restores the stack frame.
 irq_common_stub:
     pusha           ; Pushes edi, esi, ebp, esp, ebx, edx, ecx, eax
 
     mov ax, ds      ; Lower 16 bits of eax = ds
     push eax        ; save the data segment descriptor
+    KERNEL_SEGMENTS
+
+    push esp        ; Pointer to the registers_t on the stack
+    call irq_handler
+    add esp, 4
 
-    mov ax, 0x10    ; load the kernel data segment descriptor
+    RESTORE_SEGMENTS
+    popa            ; Pops edi, esi, ...
+    add esp, 8      ; Cleans up the pushed error code and pushed ISR number
+    iret            ; Pops 5 things at once: CS, EIP, EFLAGS, SS and ESP
+
+; Offset of the kernel stack pointer in the TSS.
+%define TSS_ESP0 4
+
+; In syscall.c
+[EXTERN syscall_handler]
+
+; Entry point of the sysenter instruction. The processor arrives with
+; interrupts disabled and esp pointing at its TSS, whose esp0 field holds
+; the kernel stack. The user stub below passes its stack pointer in ebp.
+; The frame built is the same as the one of int 0x80, so the dispatcher
+; does not care which path was taken.
+[GLOBAL sysenter_entry]
+sysenter_entry:
+    mov esp, [esp+TSS_ESP0]
+    push 0x23           ; User stack segment
+    push ebp            ; User stack pointer
+    pushf
+    or dword [esp], 0x200   ; Interrupts were enabled in user mode
+    push 0x1B           ; User code segment
+    push sysenter_return
+    push byte 0
+    push 0x80
+    pusha
+
+    mov ax, ds
+    push eax
+    mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
     mov gs, ax
+    cld
 
-    call irq_handler
-
-    pop ebx         ; reload the original data segment descriptor
-    mov ds, bx
-    mov es, bx
-    mov fs, bx
-    mov gs, bx
+    push esp
+    call syscall_handler
+    add esp, 4
 
-    popa            ; Pops edi, esi, ...
-    add esp, 8      ; Cleans up the pushed error code and pushed ISR number
+    pop eax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    popa
+    ; sysexit returns to edx with the stack pointer in ecx. The user stub
+    ; saved both registers. sti only takes effect after sysexit, so no
+    ; interrupt can arrive on the kernel stack with user segments loaded.
+    mov edx, [esp+8]
+    mov ecx, [esp+20]
     sti
-    iret            ; Pops 5 things at once: CS, EIP, EFLAGS, SS and ESP
+    sysexit
+
+; User side of the system call, called with the number in eax and the
+; arguments in ebx, ecx, edx, esi and edi. Only eax is changed. The kernel
+; points syscall_entry at one of the two variants.
+[GLOBAL syscall_int80]
+syscall_int80:
+    int 0x80
+    ret
+
+[GLOBAL syscall_sysenter]
+syscall_sysenter:
+    push ecx
+    push edx
+    push ebp
+    mov ebp, esp
+    sysenter
+sysenter_return:
+    pop ebp
+    pop edx
+    pop ecx
+    ret
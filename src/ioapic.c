@@ -0,0 +1,165 @@
+/*
+ * ioapic.c -- Defines the I/O APIC driver.
+ */
+
+#include "apic.h"
+#include "ioapic.h"
+#include "isr.h"
+#include "monitor.h"
+#include "paging.h"
+#include "spinlock.h"
+
+/* The registers are accessed indirectly: write the register number to
+ * IOREGSEL, then read or write IOWIN. */
+#define IOREGSEL        0x00
+#define IOWIN           0x10
+
+#define IOAPIC_VER      0x01
+#define IOAPIC_REDTBL   0x10    /* Two registers per input */
+
+/* Bits of the low half of a redirection entry. */
+#define REDIR_LOW_POLARITY  0x00002000
+#define REDIR_LEVEL         0x00008000
+#define REDIR_MASKED        0x00010000
+
+/* Polarity and trigger mode of interrupt assignments in the MP tables. A
+ * value of zero means the default of the bus, edge and active high for
+ * ISA. */
+#define MP_POLARITY_MASK    0x03
+#define MP_POLARITY_LOW     0x03
+#define MP_TRIGGER_MASK     0x0C
+#define MP_TRIGGER_LEVEL    0x0C
+
+static volatile u32int *ioapic = 0;
+static u32int ioapic_addr = 0;
+static u8int ioapic_id;
+static u32int ioapic_pins;
+
+/* Input and MP flags of each ISA interrupt. */
+static u8int isa_pin[ISA_IRQS] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+static u16int isa_flags[ISA_IRQS];
+static u8int isa_overridden[ISA_IRQS];
+
+/* Protects the register selector. */
+static spinlock_t ioapic_lock = SPINLOCK_INIT("ioapic");
+
+static u32int ioapic_read(u32int reg)
+{
+    ioapic[IOREGSEL / 4] = reg;
+    return ioapic[IOWIN / 4];
+}
+
+static void ioapic_write(u32int reg, u32int value)
+{
+    ioapic[IOREGSEL / 4] = reg;
+    ioapic[IOWIN / 4] = value;
+}
+
+void ioapic_add(u8int id, u32int addr)
+{
+    if (ioapic_addr) {
+        monitor_print("IOAPIC: ignoring I/O APIC %u\n", id);
+        return;
+    }
+    ioapic_id = id;
+    ioapic_addr = addr;
+}
+
+void ioapic_add_isa_irq(u8int irq, u8int pin, u16int flags)
+{
+    if (irq >= ISA_IRQS)
+        return;
+    isa_pin[irq] = pin;
+    isa_flags[irq] = flags;
+    isa_overridden[irq] = 1;
+}
+
+/*
+ * Build the low half of the redirection entry of an ISA interrupt.
+ */
+static u32int isa_entry(u8int irq)
+{
+    u32int low = IRQ0 + irq;
+    if ((isa_flags[irq] & MP_POLARITY_MASK) == MP_POLARITY_LOW)
+        low |= REDIR_LOW_POLARITY;
+    if ((isa_flags[irq] & MP_TRIGGER_MASK) == MP_TRIGGER_LEVEL)
+        low |= REDIR_LEVEL;
+    return low;
+}
+
+int init_ioapic(void)
+{
+    if (!ioapic_addr || !lapic_present())
+        return 0;
+
+    map_mmio(ioapic_addr);
+    ioapic = (u32int *) ioapic_addr;
+    ioapic_pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+
+    u32int flags = irq_save();
+
+    u32int pin;
+    for (pin = 0; pin < ioapic_pins; ++pin) {
+        ioapic_write(IOAPIC_REDTBL + 2 * pin + 1, 0);
+        ioapic_write(IOAPIC_REDTBL + 2 * pin, REDIR_MASKED);
+    }
+
+    /* The PICs left all interrupts unmasked, keep it that way. IRQ2 only
+     * cascades the slave PIC, its input usually belongs to the PIT. */
+    u8int irq;
+    u8int bsp = lapic_id();
+    for (irq = 0; irq < ISA_IRQS; ++irq) {
+        if ((irq == 2 && !isa_overridden[irq]) || isa_pin[irq] >= ioapic_pins)
+            continue;
+        ioapic_write(IOAPIC_REDTBL + 2 * isa_pin[irq] + 1, (u32int) bsp << 24);
+        ioapic_write(IOAPIC_REDTBL + 2 * isa_pin[irq], isa_entry(irq));
+    }
+
+    /* From now on the PICs stay silent. */
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+
+    irq_restore(flags);
+    monitor_print("IOAPIC: %u inputs at 0x%x\n", ioapic_pins, ioapic_addr);
+    return 1;
+}
+
+int ioapic_present(void)
+{
+    return ioapic != 0;
+}
+
+/*
+ * Set or clear the mask bit of the entry of an ISA interrupt.
+ */
+static void ioapic_set_masked(u8int irq, int masked)
+{
+    u32int reg = IOAPIC_REDTBL + 2 * isa_pin[irq];
+    u32int flags = spin_lock_irqsave(&ioapic_lock);
+    u32int low = ioapic_read(reg);
+    if (masked)
+        low |= REDIR_MASKED;
+    else
+        low &= ~REDIR_MASKED;
+    ioapic_write(reg, low);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+void ioapic_mask(u8int irq)
+{
+    ioapic_set_masked(irq, 1);
+}
+
+void ioapic_unmask(u8int irq)
+{
+    ioapic_set_masked(irq, 0);
+}
+
+void ioapic_set_dest(u8int irq, u8int apic_id)
+{
+    u32int flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(IOAPIC_REDTBL + 2 * isa_pin[irq] + 1, (u32int) apic_id << 24);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
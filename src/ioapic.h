@@ -0,0 +1,75 @@
+/**
+ * @file    ioapic.h
+ *
+ * Defines the interface to the I/O APIC.
+ *
+ * The I/O APIC receives interrupts of devices and sends them as messages
+ * to the Local APIC of any processor. When it is present, it replaces the
+ * 8259 PICs: ISA interrupts keep their vectors (IRQ0 to IRQ15), but they
+ * are acknowledged at the Local APIC and can be steered to any processor.
+ */
+
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include "common.h"
+
+/** Number of ISA interrupt lines. */
+#define ISA_IRQS        16
+
+/**
+ * Record an I/O APIC found in the MP tables. Only the first one is used.
+ *
+ * @param id    ID of the I/O APIC
+ * @param addr  physical address of its registers
+ */
+void ioapic_add(u8int id, u32int addr);
+
+/**
+ * Record that an ISA interrupt is connected to given input of the I/O APIC.
+ * By default interrupt n is on input n.
+ *
+ * @param irq       ISA interrupt number
+ * @param pin       input of the I/O APIC
+ * @param flags     polarity and trigger mode as found in the MP tables
+ */
+void ioapic_add_isa_irq(u8int irq, u8int pin, u16int flags);
+
+/**
+ * Route all ISA interrupts through the I/O APIC to the boot processor and
+ * disable the 8259 PICs. The Local APIC must be enabled.
+ *
+ * @return nonzero if an I/O APIC was found and enabled
+ */
+int init_ioapic(void);
+
+/**
+ * Check whether the I/O APIC handles the interrupts.
+ *
+ * @return nonzero if init_ioapic() succeeded
+ */
+int ioapic_present(void);
+
+/**
+ * Stop delivery of an ISA interrupt.
+ *
+ * @param irq   ISA interrupt number
+ */
+void ioapic_mask(u8int irq);
+
+/**
+ * Resume delivery of an ISA interrupt.
+ *
+ * @param irq   ISA interrupt number
+ */
+void ioapic_unmask(u8int irq);
+
+/**
+ * Deliver an ISA interrupt to given processor.
+ *
+ * @param irq       ISA interrupt number
+ * @param apic_id   Local APIC ID of the processor
+ */
+void ioapic_set_dest(u8int irq, u8int apic_id);
+
+#endif /* end of include guard: IOAPIC_H */
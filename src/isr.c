@@ -5,30 +5,93 @@
  * Rewritten and taken from JamesM's kernel development tutorials.
  */
 
+#include "apic.h"
+#include "clock.h"
 #include "common.h"
+#include "ioapic.h"
 #include "isr.h"
+#include "kstack.h"
 #include "monitor.h"
+#include "smp.h"
+#include "softirq.h"
+#include "task.h"
 
 isr_t interrupt_handlers[256];
 
+/* Statistics of one vector on one processor. Each processor updates only
+ * its own, so they need no locking. */
+typedef struct {
+    /* Number of invocations. */
+    u32int count;
+    /* Longest handler run, in cycles. */
+    u32int max;
+    /* Cycles spent in the handler. */
+    u64int cycles;
+} interrupt_stat_t;
+
+static interrupt_stat_t interrupt_stats[MAX_CPUS][256];
+/* Handler runs by log2 of their length in cycles, for all processors. */
+static u32int interrupt_hist[256][INTERRUPT_HIST_BUCKETS];
+
+/*
+ * Record one run of the handler of a vector.
+ */
+static void account_interrupt(u8int vector, u64int cycles)
+{
+    interrupt_stat_t *stat = &interrupt_stats[cpu_index()][vector];
+    u32int c = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (u32int) cycles;
+    stat->count++;
+    stat->cycles += cycles;
+    if (c > stat->max)
+        stat->max = c;
+
+    u32int bucket = 0;
+    if (c)
+        asm ("bsr %1, %0" : "=r" (bucket) : "rm" (c));
+    asm volatile ("lock; incl %0" : "+m" (interrupt_hist[vector][bucket]));
+}
+
+/*
+ * Call the handler of a vector and measure how long it takes.
+ */
+static void run_handler(u8int vector, isr_t handler, registers_t *regs)
+{
+    u64int start = ktime_cycles();
+    handler(regs);
+    account_interrupt(vector, ktime_cycles() - start);
+}
+
 void register_interrupt_handler(u8int n, isr_t handler)
 {
     interrupt_handlers[n] = handler;
 }
 
+/*
+ * The processor switches here through a task gate when an exception occurs
+ * while it is delivering another one. With guard-paged kernel stacks this
+ * is how a stack overflow shows up: the page fault can not push its frame.
+ */
+void double_fault_handler(void)
+{
+    u32int cr2;
+    asm volatile ("mov %%cr2, %0" : "=r" (cr2));
+    if (kstack_is_guard(cr2))
+        monitor_print("Kernel stack overflow at 0x%x\n", cr2);
+    PANIC("Double fault!");
+}
+
 /*
  * This gets called from our ASM interrupt handler stub.
  */
-void isr_handler(registers_t regs)
+void isr_handler(registers_t *regs)
 {
     /* This line is important. When the processor extends the 8-bit interrupt
      * number to a 32 bit value, it sign-extends, not zero extends. So fi the
-     * most significant bit (0x80) is set, regs.int_no will be very large
+     * most significant bit (0x80) is set, regs->int_no will be very large
      * (about 0xFFFFFF80). */
-    u8int int_no = regs.int_no & 0xFF;
-    if (interrupt_handlers[regs.int_no]) {
-        isr_t handler = interrupt_handlers[int_no];
-        handler(&regs);
+    u8int int_no = regs->int_no & 0xFF;
+    if (interrupt_handlers[int_no]) {
+        run_handler(int_no, interrupt_handlers[int_no], regs);
     } else {
         monitor_print("Unhandled interrupt: %u\n", int_no);
         for (;;);
@@ -38,16 +101,134 @@ void isr_handler(registers_t regs)
 /*
  * This gets called from our ASM interrupt handler stub.
  */
-void irq_handler(registers_t regs)
+void irq_handler(registers_t *regs)
+{
+    u8int int_no = regs->int_no;
+    if (int_no >= LAPIC_TIMER_VECTOR || ioapic_present()) {
+        /* This interrupt came from the Local APIC or through it. A single
+         * memory write acknowledges it. */
+        lapic_eoi();
+    } else {
+        /* Send an EOI (end-of-interrupt) signal to PICs. */
+        if (int_no >= 40) {     /* If this interrupt involved the slave */
+            outb(PIC2, EOI);
+        }
+        outb(PIC1, EOI);
+    }
+
+    if (interrupt_handlers[int_no])
+        run_handler(int_no, interrupt_handlers[int_no], regs);
+
+    /* The interrupt is acknowledged, run the deferred work. A nested
+     * interrupt must not switch tasks in the middle of it. */
+    do_softirq();
+    cpu_t *cpu = this_cpu();
+    if (cpu->need_resched && !cpu->in_softirq) {
+        cpu->need_resched = 0;
+        switch_task();
+    }
+}
+
+void irq_mask(u8int irq)
 {
-    /* Send an EOI (end-of-interrupt) signal to PICs. */
-    if (regs.int_no >= 40) {    /* If this interrupt involved the slave */
-        outb(PIC2, EOI);
+    if (irq >= ISA_IRQS)
+        return;
+    if (ioapic_present()) {
+        ioapic_mask(irq);
+    } else {
+        u32int flags = irq_save();
+        u16int port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+        outb(port, inb(port) | (1 << (irq & 7)));
+        irq_restore(flags);
+    }
+}
+
+void irq_unmask(u8int irq)
+{
+    if (irq >= ISA_IRQS)
+        return;
+    if (ioapic_present()) {
+        ioapic_unmask(irq);
+    } else {
+        u32int flags = irq_save();
+        u16int port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+        outb(port, inb(port) & ~(1 << (irq & 7)));
+        irq_restore(flags);
+    }
+}
+
+int irq_set_affinity(u8int irq, u32int cpu)
+{
+    /* The PICs can only interrupt the boot processor. */
+    if (irq >= ISA_IRQS || cpu >= MAX_CPUS || !cpus[cpu].online ||
+            !ioapic_present())
+        return -1;
+    ioapic_set_dest(irq, cpus[cpu].apic_id);
+    return 0;
+}
+
+int dump_interrupts(void)
+{
+    u32int vector, cpu, i;
+
+    monitor_write("vec");
+    for (cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        if (cpus[cpu].online)
+            monitor_print("      cpu%u", cpu);
     }
-    outb(PIC1, EOI);
+    monitor_write("  avg cyc  max cyc\n");
+
+    for (vector = 0; vector < 256; ++vector) {
+        u32int count = 0, max = 0;
+        u64int cycles = 0;
+        for (cpu = 0; cpu < MAX_CPUS; ++cpu) {
+            interrupt_stat_t *stat = &interrupt_stats[cpu][vector];
+            count += stat->count;
+            cycles += stat->cycles;
+            if (stat->max > max)
+                max = stat->max;
+        }
+        if (!count)
+            continue;
 
-    if (interrupt_handlers[regs.int_no]) {
-        isr_t handler = interrupt_handlers[regs.int_no];
-        handler(&regs);
+        monitor_print("%3u", vector);
+        for (cpu = 0; cpu < MAX_CPUS; ++cpu) {
+            if (cpus[cpu].online)
+                monitor_print(" %9u", interrupt_stats[cpu][vector].count);
+        }
+        monitor_print(" %8u %8u\n",
+                (u32int) div_u64_u32(cycles, count, 0), max);
+
+        /* Histogram, bucket n holds runs of 2^n to 2^(n+1)-1 cycles. */
+        monitor_write("   ");
+        for (i = 0; i < INTERRUPT_HIST_BUCKETS; ++i) {
+            if (interrupt_hist[vector][i])
+                monitor_print(" 2^%u:%u", i, interrupt_hist[vector][i]);
+        }
+        monitor_put('\n');
     }
+    return 0;
+}
+
+/*
+ * Handler of the null interrupt, it does nothing.
+ */
+static void null_handler(registers_t *regs)
+{
+}
+
+u32int measure_null_interrupt(void)
+{
+    const u32int rounds = 1000;
+    register_interrupt_handler(NULL_VECTOR, &null_handler);
+
+    /* Warm up the caches and the branch predictors first. */
+    u32int i;
+    for (i = 0; i < 16; ++i)
+        asm volatile ("int %0" :: "i" (NULL_VECTOR));
+
+    u64int start = ktime_cycles();
+    for (i = 0; i < rounds; ++i)
+        asm volatile ("int %0" :: "i" (NULL_VECTOR));
+    return (u32int) div_u64_u32(ktime_cycles() - start, rounds, 0);
 }
@@ -51,6 +51,8 @@ typedef struct {
 #define IRQ14   46      /**< Interrupt request 14 */
 #define IRQ15   47      /**< Interrupt request 15 */
 
+#define NULL_VECTOR 129 /**< Interrupt doing nothing, for measurements */
+
 /**
  * Enables registration of callbacks for interrupts and IRQs.
  * For IRQs, to ease the confusion, use #defines above as the first parameter.
@@ -64,4 +66,48 @@ typedef void (*isr_t)(registers_t*);
  */
 void register_interrupt_handler(u8int n, isr_t handler);
 
+/**
+ * Measure the cost of the interrupt entry and exit path by raising an
+ * interrupt whose handler does nothing. The clock must be initialised.
+ *
+ * @return average number of cycles per interrupt
+ */
+u32int measure_null_interrupt(void);
+
+/** Number of buckets of the interrupt latency histograms. */
+#define INTERRUPT_HIST_BUCKETS  32
+
+/**
+ * Print number of invocations of every used vector on each processor, the
+ * average and longest handler run and a histogram of handler runs by log2
+ * of their length in cycles, like /proc/interrupts.
+ *
+ * @return zero
+ */
+int dump_interrupts(void);
+
+/**
+ * Stop delivery of an interrupt request.
+ *
+ * @param irq   number of the request, 0 for IRQ0
+ */
+void irq_mask(u8int irq);
+
+/**
+ * Resume delivery of an interrupt request.
+ *
+ * @param irq   number of the request, 0 for IRQ0
+ */
+void irq_unmask(u8int irq);
+
+/**
+ * Deliver an interrupt request to given processor. It needs the I/O APIC,
+ * with the PICs all requests go to the boot processor.
+ *
+ * @param irq   number of the request, 0 for IRQ0
+ * @param cpu   index of the processor in cpus[]
+ * @return 0 on success, -1 if the request can not be moved
+ */
+int irq_set_affinity(u8int irq, u32int cpu);
+
 #endif /* end of include guard: ISR_H */
@@ -9,9 +9,19 @@
 #include "kb.h"
 #include "kheap.h"
 #include "monitor.h"
+#include "softirq.h"
 
 static u8int *kbmap;
 
+/* Characters typed but not yet echoed. The interrupt handler is the only
+ * writer and the tasklet the only reader. */
+#define KB_BUFFER_SIZE  64
+static volatile u8int kb_buffer[KB_BUFFER_SIZE];
+static volatile u32int kb_head, kb_tail;
+
+/* Echoes the typed characters outside of the interrupt handler. */
+static tasklet_t kb_tasklet;
+
 /* Bitfield representing the state of a keyboard. */
 u8int kb_state;
 
@@ -55,14 +65,32 @@ static void keyboard_handler(registers_t *regs)
             kb_state |= KB_STATE_CTRL;
             break;
         default:
-            monitor_put(kbmap[scancode + (kb_state & KB_STATE_SHIFT ? 128 : 0)]);
+            /* Drop the key when the buffer is full. */
+            if (kb_head - kb_tail < KB_BUFFER_SIZE) {
+                kb_buffer[kb_head % KB_BUFFER_SIZE] =
+                    kbmap[scancode + (kb_state & KB_STATE_SHIFT ? 128 : 0)];
+                kb_head++;
+                tasklet_schedule(&kb_tasklet);
+            }
         }
     }
 }
 
+/*
+ * Bottom half of the keyboard interrupt: write out the buffered keys.
+ */
+static void keyboard_tasklet(void *arg)
+{
+    while (kb_tail != kb_head) {
+        monitor_put(kb_buffer[kb_tail % KB_BUFFER_SIZE]);
+        kb_tail++;
+    }
+}
+
 void initialise_keyboard(u8int *map)
 {
     kbmap = kmalloc(256);
     memcpy(kbmap, map, 256);
+    tasklet_init(&kb_tasklet, &keyboard_tasklet, 0);
     register_interrupt_handler(IRQ1, &keyboard_handler);
 }
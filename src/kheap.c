@@ -5,6 +5,8 @@
 
 #include "kheap.h"
 #include "paging.h"
+#include "smp.h"
+#include "spinlock.h"
 
 /**
  * Header of heap section.
@@ -66,28 +68,128 @@ u32int placement_address = (u32int) &end;
 /* defined in paging.c */
 extern page_directory_t *kernel_directory;
 
+/* Allocations made from placement_address before the heap exists, in
+ * address order. They live in identity mapped memory below the heap. */
+typedef struct {
+    u32int start;
+    u32int end;
+    u8int freed;
+} boot_alloc_t;
+
+static boot_alloc_t boot_allocs[BOOT_ALLOCS_MAX];
+static u32int nboot_allocs = 0;
+/* Start of the arena, and whether its unused pages were given back. */
+static u32int boot_start;
+static u8int boot_released = 0;
+
+/* Protects kheap. Nothing allocates while it is held: every page table
+ * the heap maps pages into is created at boot, so the heap only ever calls
+ * get_page() without `make`. The owner is kept to catch violations. */
+static spinlock_t heap_lock = SPINLOCK_INIT("heap");
+static volatile s32int heap_owner = -1;
+
+static u32int heap_lock_acquire(void)
+{
+    u32int flags = irq_save();
+    ASSERT(heap_owner != (s32int) cpu_index());
+    spin_lock(&heap_lock);
+    heap_owner = cpu_index();
+    return flags;
+}
+
+static void heap_lock_release(u32int flags)
+{
+    heap_owner = -1;
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
 void * kmalloc_internal(u32int sz, int align, u32int *phys)
 {
     if (kheap) {
+        u32int flags = heap_lock_acquire();
         void *addr = alloc(kheap, sz, (u8int)align);
         if (phys) {
             page_t *page = get_page((u32int) addr, 0, kernel_directory);
             *phys = page->frame * 0x1000 + ((u32int) addr & 0xFFF);
         }
+        heap_lock_release(flags);
         return addr;
     }
+    if (!nboot_allocs)
+        boot_start = placement_address;
+    ASSERT(nboot_allocs < BOOT_ALLOCS_MAX);
+
     /* If the address is not already aligned, align it. */
-    if (align == 1 && !PAGE_ALIGNED(placement_address)) {
-        PAGE_ALIGN(placement_address);
-    }
+    if (align == 1)
+        placement_address = (placement_address + 0xFFF) & 0xFFFFF000;
     if (phys) {
         *phys = placement_address;
     }
     u32int tmp = placement_address;
     placement_address += sz;
+
+    boot_alloc_t *a = &boot_allocs[nboot_allocs++];
+    a->start = tmp;
+    a->end   = placement_address;
+    a->freed = 0;
     return (void *) tmp;
 }
 
+/*
+ * Give back the whole pages between start and end that no live boot
+ * allocation touches.
+ */
+static void boot_release_pages(u32int start, u32int end)
+{
+    u32int page, i;
+    start &= 0xFFFFF000;
+    if (start < boot_start)
+        start = (boot_start + 0xFFF) & 0xFFFFF000;
+
+    for (page = start; page + 0x1000 <= end; page += 0x1000) {
+        for (i = 0; i < nboot_allocs; ++i) {
+            boot_alloc_t *a = &boot_allocs[i];
+            if (!a->freed && a->start < page + 0x1000 && a->end > page)
+                break;
+        }
+        if (i == nboot_allocs)
+            free_identity_range(page, page + 0x1000);
+    }
+}
+
+/*
+ * Free an allocation of the boot arena. The last one is returned to
+ * placement_address while there is no heap; any other one gives its pages
+ * back once boot_arena_release() has run.
+ */
+static void boot_free(void *p)
+{
+    u32int i;
+    for (i = 0; i < nboot_allocs; ++i) {
+        if (boot_allocs[i].start == (u32int) p && !boot_allocs[i].freed)
+            break;
+    }
+    ASSERT(i < nboot_allocs);
+    boot_alloc_t *a = &boot_allocs[i];
+    a->freed = 1;
+
+    if (!kheap) {
+        while (nboot_allocs && boot_allocs[nboot_allocs - 1].freed)
+            placement_address = boot_allocs[--nboot_allocs].start;
+        return;
+    }
+    if (boot_released)
+        boot_release_pages(a->start, (a->end + 0xFFF) & 0xFFFFF000);
+}
+
+void boot_arena_release(u32int mapped_end)
+{
+    ASSERT(kheap && !boot_released);
+    boot_released = 1;
+    if (nboot_allocs)
+        boot_release_pages(boot_start, mapped_end);
+}
+
 void * kmalloc(u32int sz)
 {
     return kmalloc_internal(sz, 0, 0);
@@ -110,7 +212,12 @@ void * kmalloc_ap(u32int sz, u32int *phys)
 
 void kfree(void *p)
 {
-    free(kheap, p);
+    u32int flags = heap_lock_acquire();
+    if (p && (u32int) p < KHEAP_START)
+        boot_free(p);
+    else
+        free(kheap, p);
+    heap_lock_release(flags);
 }
 
 /*
@@ -142,6 +249,27 @@ static s32int find_smallest_hole(heap_t *heap, u32int size, u8int page_align)
     return iter == heap->index.size ? -1 /* Not found */ : (s32int) iter;
 }
 
+/*
+ * Add a hole to the index of a heap, first mapping another page of the
+ * index if it is full. The page table of the index exists from the start,
+ * so this never allocates from the heap while the index is changing.
+ */
+static void index_insert(heap_t *heap, header_t *hole)
+{
+    ordered_array_t *index = &heap->index;
+    if (index->size == index->max_size) {
+        u32int page = (u32int) (index->data + index->max_size);
+        ASSERT(page < heap->start_addr);
+        /* The index is only ever used by the kernel, whatever the heap
+         * hands out. */
+        page_t *p = get_page(page, 0, kernel_directory);
+        ASSERT(p);
+        alloc_frame(p, 1, 1);
+        index->max_size += 0x1000 / sizeof(type_t);
+    }
+    oa_insert(index, hole);
+}
+
 /*
  * Compare two headers by their size.
  */
@@ -160,18 +288,14 @@ heap_t * heap_create(u32int start, u32int end, u32int max,
     ASSERT(start % 0x1000 == 0);
     ASSERT(end % 0x1000 == 0);
 
-    /* Initialize the index. */
-    heap->index = oa_place((void *) start, HEAP_INDEX_SIZE, &header_compare);
+    /* Initialize the index. It has no pages yet, index_insert() maps them
+     * as they are needed. */
+    heap->index = oa_place((void *) start, 0, &header_compare);
 
     /* Shift the start address forward to resemble where we can start putting
      * data. */
     start += sizeof(type_t) * HEAP_INDEX_SIZE;
 
-    /* Make sure the start address is page aligned now. */
-    if (!PAGE_ALIGNED(start)) {
-        PAGE_ALIGN(start);
-    }
-
     /* Write the start, end and max addresses into the heap structure. */
     heap->start_addr = start;
     heap->end_addr   = end;
@@ -184,7 +308,7 @@ heap_t * heap_create(u32int start, u32int end, u32int max,
     hole->size = end - start;
     hole->magic = HEAP_MAGIC;
     hole->is_hole = 1;
-    oa_insert(&heap->index, hole);
+    index_insert(heap, hole);
 
     return heap;
 }
@@ -204,8 +328,9 @@ static void expand(heap_t *heap, u32int new_size)
     u32int old_size = heap->end_addr - heap->start_addr;
     u32int i = old_size;
     while (i < new_size) {
-        alloc_frame(get_page(heap->start_addr + i, 1, kernel_directory),
-                heap->supervisor ? 1 : 0, heap->readonly ? 0 : 1);
+        page_t *page = get_page(heap->start_addr + i, 0, kernel_directory);
+        ASSERT(page);
+        alloc_frame(page, heap->supervisor ? 1 : 0, heap->readonly ? 0 : 1);
         i += 0x1000;
     }
     heap->end_addr = heap->start_addr + new_size;
@@ -274,7 +399,7 @@ void * alloc(heap_t *heap, u32int size, u8int page_align)
             footer_t *foot = FOOTER_T(old_end_addr + head->size - sizeof(footer_t));
             foot->magic = HEAP_MAGIC;
             foot->header = head;
-            oa_insert(&heap->index, head);
+            index_insert(heap, head);
         } else {
             /* The last header needs adjusting. */
             header_t *head = oa_lookup(&heap->index, idx);
@@ -345,7 +470,7 @@ void * alloc(heap_t *heap, u32int size, u8int page_align)
             footer->magic = HEAP_MAGIC;
             footer->header = header;
         }
-        oa_insert(&heap->index, header);
+        index_insert(heap, header);
     }
 
     /* And we are done! */
@@ -414,5 +539,5 @@ void free(heap_t *heap, void *p)
     }
 
     if (do_add)
-        oa_insert(&heap->index, header);
+        index_insert(heap, header);
 }
@@ -14,10 +14,19 @@
 
 /** Address where to put kernel heap. */
 #define KHEAP_START         0xC0000000
-/** Initial size of a heap. */
-#define KHEAP_INIT_SIZE     0x100000
-/** Size of heap index. */
-#define HEAP_INDEX_SIZE    0x20000
+/** Maximal number of holes in a heap index. The index takes the start of
+ * the heap, one page table for the kernel heap, and its pages are only
+ * mapped as it grows. */
+#define HEAP_INDEX_SIZE     0x100000
+/** Address where the data of the kernel heap starts, after its index. */
+#define KHEAP_DATA_START    (KHEAP_START + HEAP_INDEX_SIZE * sizeof(type_t))
+/** Initial size of the data of a heap. */
+#define KHEAP_INIT_SIZE     0x80000
+/** Largest size of the data of the kernel heap, as much as there is
+ * memory. The page tables covering it are created at boot. */
+#define KHEAP_MAX_SIZE      0x1000000
+/** Maximal number of allocations made before the heap exists. */
+#define BOOT_ALLOCS_MAX     32
 /** Magic number to verify consistency of memory. */
 #define HEAP_MAGIC          0x123890AB
 /** Minimal size of a heap. Do not contract the heap if size would fall
@@ -43,7 +52,9 @@ typedef struct {
 } heap_t;
 
 /**
- * Create a new heap.
+ * Create a new heap. Its index takes HEAP_INDEX_SIZE entries from start,
+ * the data follows. The page table of the index must exist, its pages are
+ * mapped by the heap; the data up to end must be mapped by the caller.
  *
  * @param start         start address of the heap
  * @param end           end address of the heap
@@ -124,10 +135,21 @@ void * kmalloc_p(u32int sz, u32int *phys);
 void * kmalloc_ap(u32int sz, u32int *phys);
 
 /**
- * Free memory allocated with kmalloc after heap was enabled.
+ * Free memory allocated with kmalloc. Memory allocated before the heap was
+ * enabled comes from the boot arena, and its pages are reused only when no
+ * other allocation shares them.
  *
  * @param p address which should be freed
  */
 void kfree(void *p);
 
+/**
+ * Give the pages of the boot arena that no allocation uses to the frame
+ * allocator: alignment gaps, freed allocations and the identity mapped
+ * pages past the last allocation. Called once, when the heap is live.
+ *
+ * @param mapped_end    end of the identity mapped memory
+ */
+void boot_arena_release(u32int mapped_end);
+
 #endif /* end of include guard: KHEAP_H */
@@ -6,6 +6,7 @@
 
 #include <string.h>
 
+#include "clock.h"
 #include "common.h"
 #include "descriptor-tables.h"
 #include "fs.h"
@@ -15,6 +16,9 @@
 #include "monitor.h"
 #include "multiboot.h"
 #include "paging.h"
+#include "serial.h"
+#include "softirq.h"
+#include "smp.h"
 #include "task.h"
 #include "timer.h"
 #include "syscall.h"
@@ -31,24 +35,29 @@ int kmain(struct multiboot *mboot_ptr, u32int initial_stack)
     initial_esp = initial_stack;
     init_descriptor_tables();
     monitor_clear();
+    init_serial();
+    init_softirq();
     /* Initialise the PIT to 100 Hz. */
     asm volatile ("sti");
     init_timer(50);
+    init_clock();
+#ifdef BENCH
+    monitor_print("Null interrupt takes %u cycles\n", measure_null_interrupt());
+#endif
 
     /* Find the location of our initial ramdisk. */
     ASSERT(mboot_ptr->mods_count > 0);
     u32int initrd_location = *((u32int*)mboot_ptr->mods_addr);
     u32int initrd_end = *((u32int*)(mboot_ptr->mods_addr+4));
 
-    /* Do not trample our module with placement accesses, please! */
+    /* Do not trample our module with placement accesses, please! Start on
+     * a fresh page, so that the module's pages can be freed on their own. */
+    initrd_end = (initrd_end + 0xFFF) & 0xFFFFF000;
     placement_address = initrd_end;
 
     /* Start paging. */
     initialise_paging();
 
-    /* Start multitasking. */
-    //initialise_tasking();
-
     /* Initialise the initial ramdisk, and set it as the filesystem root. */
     fs_root = initialise_initrd(initrd_location);
 
@@ -58,5 +67,33 @@ int kmain(struct multiboot *mboot_ptr, u32int initial_stack)
     read_fs(keymap_file, 0, 256, keymap);
     initialise_keyboard(keymap);
 
+    /* Nothing else in the ramdisk is needed after boot; files that are
+     * would be moved out with initrd_keep() first. */
+    initrd_release();
+    /* Only this processor may have the module in its TLB: free it before
+     * the others start. */
+    free_identity_range(initrd_location, initrd_end);
+
+    /* Wake up the other processors. */
+    initialise_smp();
+
+    /* Stop the periodic tick where the hardware allows it. */
+    init_tickless();
+
+    /* Start multitasking. */
+    initialise_tasking();
+
+    /* Let user mode call into the kernel. */
+    initialise_syscalls();
+
+#ifdef BENCH
+    /* sysexit only returns to user mode, so the first task measures system
+     * calls from there, and stays there. */
+    switch_to_user_mode();
+    bench_syscalls();
+    for (;;)
+        ;
+#endif
+
     return 0;
 }
@@ -0,0 +1,55 @@
+/*
+ * kstack.c -- Defines the pool of guard-paged kernel stacks.
+ */
+
+#include "kstack.h"
+#include "paging.h"
+#include "spinlock.h"
+
+/* defined in paging.c */
+extern page_directory_t *kernel_directory;
+
+/* Stacks that were freed. The first word of each holds the next one. */
+static u32int free_stacks = 0;
+/* Index of the first slot that was never used. */
+static u32int next_slot = 0;
+/* Protects free_stacks and next_slot. */
+static spinlock_t kstack_lock = SPINLOCK_INIT("kstack");
+
+u32int kstack_alloc(void)
+{
+    u32int flags = spin_lock_irqsave(&kstack_lock);
+    u32int stack = free_stacks;
+    if (stack) {
+        free_stacks = *(u32int *) stack;
+        spin_unlock_irqrestore(&kstack_lock, flags);
+        return stack;
+    }
+
+    if (next_slot == KSTACK_SLOTS)
+        PANIC("Out of kernel stacks!");
+    stack = KSTACK_START + next_slot++ * KSTACK_SLOT_SIZE + 0x1000;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+
+    /* The page table was created at boot, the guard page stays unmapped. */
+    u32int i;
+    for (i = stack; i < stack + KERNEL_STACK_SIZE; i += 0x1000)
+        alloc_frame(get_page(i, 0, kernel_directory), 1, 1);
+    return stack;
+}
+
+void kstack_free(u32int stack)
+{
+    ASSERT(stack >= KSTACK_START && stack < KSTACK_END);
+    u32int flags = spin_lock_irqsave(&kstack_lock);
+    *(u32int *) stack = free_stacks;
+    free_stacks = stack;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
+
+int kstack_is_guard(u32int addr)
+{
+    if (addr < KSTACK_START || addr >= KSTACK_END)
+        return 0;
+    return (addr - KSTACK_START) % KSTACK_SLOT_SIZE < 0x1000;
+}
@@ -0,0 +1,51 @@
+/**
+ * @file    kstack.h
+ *
+ * Defines the pool of kernel stacks.
+ *
+ * Kernel stacks live in a dedicated region of fixed-size slots. Each slot
+ * starts with an unmapped guard page, so a stack overflow causes a page
+ * fault instead of silently corrupting the neighbouring stack. Freed stacks
+ * keep their frames and are recycled through a free list.
+ */
+
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include "common.h"
+
+/** Size of one kernel stack. Must be a multiple of the page size. */
+#define KERNEL_STACK_SIZE   0x2000
+/** Start of the kernel stack region. */
+#define KSTACK_START        0xD0000000
+/** Number of slots in the region. */
+#define KSTACK_SLOTS        256
+/** Size of one slot: guard page followed by the stack. */
+#define KSTACK_SLOT_SIZE    (0x1000 + KERNEL_STACK_SIZE)
+/** End of the kernel stack region. */
+#define KSTACK_END          (KSTACK_START + KSTACK_SLOTS * KSTACK_SLOT_SIZE)
+
+/**
+ * Allocate a kernel stack.
+ *
+ * @return the lowest address of the stack, the stack pointer should start
+ *         at the returned value + #KERNEL_STACK_SIZE
+ */
+u32int kstack_alloc(void);
+
+/**
+ * Return a stack to the pool.
+ *
+ * @param stack value returned by kstack_alloc()
+ */
+void kstack_free(u32int stack);
+
+/**
+ * Check whether an address lies in a guard page of the stack region.
+ *
+ * @param addr  address to check
+ * @return nonzero if accessing the address means a stack overflowed
+ */
+int kstack_is_guard(u32int addr);
+
+#endif /* end of include guard: KSTACK_H */
@@ -70,7 +70,9 @@ type_t oa_lookup(ordered_array_t *array, u32int i)
 
 void oa_remove(ordered_array_t *array, u32int i)
 {
-    while (i < array->size) {
+    /* Do not read past the last item, the memory after it may not be
+     * mapped. */
+    while (i + 1 < array->size) {
         array->data[i] = array->data[i+1];
         i++;
     }
@@ -4,20 +4,25 @@
 
 #include <string.h>
 
+#include "descriptor-tables.h"
 #include "isr.h"
 #include "kheap.h"
+#include "kstack.h"
 #include "monitor.h"
 #include "paging.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "task.h"
+#include "vdso.h"
 
 /* The kernel's page directory. */
 page_directory_t *kernel_directory = 0;
 
-/* The current page directory. */
-page_directory_t *current_directory = 0;
-
 /* A bitset of frames - used or free. */
 u32int *frames;
 u32int nframes;
+/* Protects frames. */
+static spinlock_t frame_lock = SPINLOCK_INIT("frames");
 
 /* defined in kheap.c */
 extern u32int placement_address;
@@ -83,11 +88,13 @@ void alloc_frame(page_t *page, int is_kernel, int is_writable)
     if (page->frame != 0) {
         return;     /* Frame was already allocated, return straight away. */
     }
+    u32int flags = spin_lock_irqsave(&frame_lock);
     u32int idx = first_frame(); /* idx is now the index of the first frame */
     if (idx == (u32int) - 1) {
         PANIC("No free frames!");
     }
     set_frame(idx * 0x1000);    /* this frame is ours now */
+    spin_unlock_irqrestore(&frame_lock, flags);
     page->present   = 1;
     page->rw        = is_writable ? 1 : 0;
     page->user      = is_kernel ? 0 : 1;
@@ -100,7 +107,9 @@ void free_frame(page_t *page)
     if (!frame) {
         return;     /* The given page didn't actually have an allocated frame */
     }
+    u32int flags = spin_lock_irqsave(&frame_lock);
     clear_frame(frame);
+    spin_unlock_irqrestore(&frame_lock, flags);
     page->frame = 0x0;
 }
 
@@ -125,9 +134,25 @@ void initialise_paging(void)
      * they need to be identity mapped first below, and yet we can't increase
      * placement_address between identity mapping and enabling the heap. */
     u32int i = 0;
-    for (i = KHEAP_START; i < KHEAP_START + KHEAP_INIT_SIZE; i += 0x1000)
+    for (i = KHEAP_DATA_START; i < KHEAP_DATA_START + KHEAP_INIT_SIZE;
+            i += 0x1000)
+        get_page(i, 1, kernel_directory);
+    /* The heap can not allocate its own page tables while it is locked, so
+     * create all of them now: the one of the index, which maps its pages
+     * itself as it grows, and those of the data up to its largest size. */
+    get_page(KHEAP_START, 1, kernel_directory);
+    for (i = KHEAP_DATA_START; i < KHEAP_DATA_START + KHEAP_MAX_SIZE;
+            i += 0x400000)
         get_page(i, 1, kernel_directory);
 
+    /* Create the page tables for kernel stacks and device registers too,
+     * so that pages mapped there later are visible in every address
+     * space. */
+    for (i = KSTACK_START; i < KSTACK_END; i += 0x400000)
+        get_page(i, 1, kernel_directory);
+    get_page(MMIO_BASE, 1, kernel_directory);
+    map_vdso(kernel_directory);
+
     /* We need to identity map (phys addr = virt addr) from 0x0 to the end
      * of the used memory, so we can access this transparently, as if paging
      * wasn't enabled.
@@ -143,9 +168,11 @@ void initialise_paging(void)
         alloc_frame(get_page(i, 1, kernel_directory), 0, 0);
         i += 0x1000;
     }
+    u32int identity_end = i;
 
     /* Now allocate those pages we mapped earlier. */
-    for (i = KHEAP_START; i < KHEAP_START + KHEAP_INIT_SIZE; i += 0x1000)
+    for (i = KHEAP_DATA_START; i < KHEAP_DATA_START + KHEAP_INIT_SIZE;
+            i += 0x1000)
         alloc_frame(get_page(i, 1, kernel_directory), 0, 0);
 
     /* Before we enable paging, we must register our page fault handler. */
@@ -153,10 +180,15 @@ void initialise_paging(void)
 
     /* Now, enable paging! */
     switch_page_directory(kernel_directory);
+    set_double_fault_cr3(kernel_directory->physicalAddr);
 
     /* Initialize the kernel heap. */
-    kheap = heap_create(KHEAP_START, KHEAP_START+KHEAP_INIT_SIZE,
-            0xCFFFF000, 0, 0);
+    kheap = heap_create(KHEAP_START, KHEAP_DATA_START+KHEAP_INIT_SIZE,
+            KHEAP_DATA_START+KHEAP_MAX_SIZE, 0, 0);
+
+    /* Everything from now on comes from the heap, so the spare pages mapped
+     * for the placement allocations can go. */
+    boot_arena_release(identity_end);
 
     current_directory = clone_directory(kernel_directory);
     switch_page_directory(current_directory);
@@ -172,6 +204,35 @@ void switch_page_directory(page_directory_t *dir)
     asm volatile ("mov %0, %%cr0" :: "r"(cr0));
 }
 
+void map_mmio(u32int addr)
+{
+    ASSERT(addr >= MMIO_BASE && addr < MMIO_END);
+    page_t *page = get_page(addr, 0, kernel_directory);
+    page->present = 1;
+    page->rw      = 1;
+    page->user    = 0;
+    page->frame   = addr / 0x1000;
+    asm volatile ("invlpg (%0)" :: "r" (addr) : "memory");
+}
+
+void free_identity_range(u32int start, u32int end)
+{
+    /* The pages are only flushed from the TLB of this processor. */
+    ASSERT(ncpus == 1);
+    start = (start + 0xFFF) & 0xFFFFF000;
+    end &= 0xFFFFF000;
+    for (; start < end; start += 0x1000) {
+        page_t *page = get_page(start, 0, kernel_directory);
+        if (!page)
+            continue;
+        /* The low page tables are shared by every address space, so this
+         * unmaps the range everywhere. */
+        free_frame(page);
+        page->present = 0;
+        asm volatile ("invlpg (%0)" :: "r" (start) : "memory");
+    }
+}
+
 page_t *get_page(u32int address, int make, page_directory_t *dir)
 {
     /* Turn the address into an index. */
@@ -191,6 +252,54 @@ page_t *get_page(u32int address, int make, page_directory_t *dir)
     return 0;
 }
 
+/*
+ * Check that a page is mapped and accessible from user mode.
+ */
+static int user_page_ok(u32int addr, int write)
+{
+    /* Pages of the kernel heap, which holds the page tables and the task
+     * structures, are mapped for user mode but belong to the kernel. The
+     * rest is decided by the page: the identity mapped kernel is readable
+     * from user mode, the boot stack user mode runs on is writable. */
+    if (addr >= KHEAP_START && addr < KHEAP_DATA_START + KHEAP_MAX_SIZE)
+        return 0;
+    page_t *page = get_page(addr, 0, current_directory);
+    return page && page->present && page->user && (!write || page->rw);
+}
+
+int user_range_ok(const void *addr, u32int size, int write)
+{
+    u32int start = (u32int) addr;
+    if (!size)
+        return 1;
+    if (start + size - 1 < start)
+        return 0;
+
+    u32int page, last = (start + size - 1) & 0xFFFFF000;
+    for (page = start & 0xFFFFF000; ; page += 0x1000) {
+        if (!user_page_ok(page, write))
+            return 0;
+        if (page == last)
+            return 1;
+    }
+}
+
+int user_string_ok(const char *str)
+{
+    u32int addr = (u32int) str;
+    for (;;) {
+        if (!user_page_ok(addr, 0))
+            return 0;
+        /* Look for the end of the string in the rest of this page. */
+        do {
+            if (!*(const char *) addr)
+                return 1;
+        } while (++addr & 0xFFF);
+        if (!addr)
+            return 0;
+    }
+}
+
 static void page_fault(registers_t *regs)
 {
     /* A page fault has occurred.
@@ -198,6 +307,15 @@ static void page_fault(registers_t *regs)
     u32int faulting_address;
     asm volatile ("mov %%cr2, %0" : "=r"(faulting_address));
 
+    task_t *task = get_current_task();
+    if (task)
+        task->usage.page_faults++;
+
+    if (kstack_is_guard(faulting_address)) {
+        monitor_print("Kernel stack overflow at 0x%x\n", faulting_address);
+        PANIC("Kernel stack overflow!");
+    }
+
     /* The error code gives us details of what happened. */
     int present  = !(regs->err_code & 0x1); /* Page not present */
     int rw       = regs->err_code & 0x2;    /* Write operation? */
@@ -256,6 +374,20 @@ static page_table_t *clone_table(page_table_t *src, u32int *physAddr)
     return table;
 }
 
+u32int count_private_pages(page_directory_t *dir)
+{
+    u32int i, j, count = 0;
+    for (i = 0; i < 1024; ++i) {
+        if (!dir->tables[i] || dir->tables[i] == kernel_directory->tables[i])
+            continue;
+        for (j = 0; j < 1024; ++j) {
+            if (dir->tables[i]->pages[j].frame)
+                count++;
+        }
+    }
+    return count;
+}
+
 page_directory_t *clone_directory(page_directory_t *src)
 {
     u32int phys;
@@ -277,7 +409,9 @@ page_directory_t *clone_directory(page_directory_t *src)
             continue;
 
         if (kernel_directory->tables[i] == src->tables[i]) {
-            /* It's in the kernel, so just use the same pointer. */
+            /* It's in the kernel, so just use the same pointer. This
+             * includes the table of the vDSO page, which every address
+             * space shares read-only. */
             dir->tables[i] = src->tables[i];
             dir->tablesPhysical[i] = src->tablesPhysical[i];
         } else {
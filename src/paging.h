@@ -48,6 +48,14 @@ typedef struct {
     u32int physicalAddr;
 } page_directory_t;
 
+/** Start of the memory mapped I/O area holding the APIC registers. The page
+ * table for this area is created at boot, so it is shared by all address
+ * spaces. */
+#define MMIO_BASE   0xFEC00000
+/** End of the memory mapped I/O area, the one page table created for it
+ * covers up to here. */
+#define MMIO_END    (MMIO_BASE + 0x400000)
+
 /**
  * Sets up the environment, page directories, etc. and enables paging.
  */
@@ -80,6 +88,55 @@ void alloc_frame(page_t *page, int is_kernel, int is_writable);
  */
 void free_frame(page_t *page);
 
+/**
+ * Identity map a page of device registers into the kernel address space.
+ *
+ * @param addr  physical address of the registers, must be between
+ *              MMIO_BASE and MMIO_END
+ */
+void map_mmio(u32int addr);
+
+/**
+ * Unmap part of the identity mapped memory below the heap and give its
+ * frames back to the frame allocator. Only whole pages inside the range are
+ * freed. The range is only flushed from the TLB of the executing processor,
+ * so this must be done before the other processors are started.
+ *
+ * @param start start of the range
+ * @param end   end of the range
+ */
+void free_identity_range(u32int start, u32int end);
+
+/**
+ * Check that user mode may access a memory range in the current address
+ * space. All pages of the range must be present and accessible from ring 3,
+ * and none may be part of the kernel heap.
+ *
+ * @param addr  start of the range
+ * @param size  length of the range in bytes
+ * @param write nonzero if the range will be written to
+ * @return nonzero if the access is allowed
+ */
+int user_range_ok(const void *addr, u32int size, int write);
+
+/**
+ * Check that user mode may read a null terminated string in the current
+ * address space.
+ *
+ * @param str   the string
+ * @return nonzero if the whole string, including the null byte, is readable
+ */
+int user_string_ok(const char *str);
+
+/**
+ * Count pages with a frame in the tables that are not shared with the
+ * kernel.
+ *
+ * @param dir   directory to inspect
+ * @return number of private pages
+ */
+u32int count_private_pages(page_directory_t *dir);
+
 /**
  * Clone a page directory.
  *
@@ -0,0 +1,197 @@
+/*
+ * profile.c -- Defines the timer driven sampling profiler.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "clock.h"
+#include "kheap.h"
+#include "profile.h"
+#include "serial.h"
+#include "smp.h"
+#include "task.h"
+#include "timer.h"
+
+/* Samples of one processor. Only that processor writes them, so there is
+ * no locking; the dump runs once sampling has stopped. Once the ring is
+ * full, every new sample overwrites the oldest one. */
+typedef struct {
+    profile_sample_t *samples;
+    /* Number of samples taken, sample i is stored at i % PROFILE_SAMPLES. */
+    u32int count;
+    /* Number of samples overwritten before they were dumped. */
+    u32int lost;
+    /* Time when the next sample is due. */
+    u64int next;
+} profile_ring_t;
+
+static profile_ring_t rings[MAX_CPUS];
+static volatile int profiling = 0;
+static u32int profile_hz;
+static u32int period_ns;
+
+/*
+ * Find the end of the kernel stack holding ebp: the stack of the current
+ * task, of the idle task of the processor (the boot stack of application
+ * processors) or the boot stack of the first task. Return zero when ebp is
+ * on none of them, it is then no frame pointer we can trust.
+ */
+static u32int stack_limit(u32int ebp)
+{
+    task_t *task = get_current_task();
+    if (task && ebp >= task->kernel_stack &&
+            ebp < task->kernel_stack + KERNEL_STACK_SIZE)
+        return task->kernel_stack + KERNEL_STACK_SIZE;
+
+    task = this_cpu()->idle_task;
+    if (task && ebp >= task->kernel_stack &&
+            ebp < task->kernel_stack + KERNEL_STACK_SIZE)
+        return task->kernel_stack + KERNEL_STACK_SIZE;
+
+    if (ebp >= BOOT_STACK_TOP - BOOT_STACK_SIZE && ebp < BOOT_STACK_TOP)
+        return BOOT_STACK_TOP;
+    return 0;
+}
+
+/*
+ * Follow the frame pointers of the interrupted kernel code. Only frames
+ * above the interrupted one and within its stack are followed, so a
+ * corrupted chain never makes us touch unmapped memory.
+ */
+static u8int backtrace(u32int ebp, u32int *stack)
+{
+    u32int limit = stack_limit(ebp);
+
+    u8int depth = 0;
+    while (depth < PROFILE_DEPTH && ebp && !(ebp & 3) &&
+            ebp + 8 <= limit) {
+        u32int *frame = (u32int *) ebp;
+        if (!frame[1])
+            break;
+        stack[depth++] = frame[1];
+        if (frame[0] <= ebp)
+            break;
+        ebp = frame[0];
+    }
+    return depth;
+}
+
+void profile_start(u32int hz)
+{
+    profiling = 0;
+    if (hz > PROFILE_MAX_HZ)
+        hz = PROFILE_MAX_HZ;
+    profile_hz = hz;
+    period_ns = NSEC_PER_SEC / hz;
+
+    u64int now = ktime_ns();
+    u32int i;
+    for (i = 0; i < MAX_CPUS; ++i) {
+        profile_ring_t *ring = &rings[i];
+        if (!cpus[i].online)
+            continue;
+        if (!ring->samples)
+            ring->samples = kmalloc(PROFILE_SAMPLES * sizeof(profile_sample_t));
+        ring->count = ring->lost = 0;
+        ring->next = now;
+    }
+    profiling = 1;
+
+    /* Tickless processors may have no timer running, make them start. */
+    for (i = 0; i < MAX_CPUS; ++i) {
+        if (cpus[i].online)
+            timer_kick(&cpus[i]);
+    }
+}
+
+void profile_stop(void)
+{
+    profiling = 0;
+}
+
+void profile_tick(registers_t *regs)
+{
+    if (!profiling)
+        return;
+
+    profile_ring_t *ring = &rings[cpu_index()];
+    u64int now = ktime_ns();
+    if (!ring->samples || now < ring->next)
+        return;
+    ring->next = now + period_ns;
+
+    if (ring->count >= PROFILE_SAMPLES)
+        ring->lost++;
+    profile_sample_t *sample = &ring->samples[ring->count++ % PROFILE_SAMPLES];
+    task_t *task = get_current_task();
+    sample->eip = regs->eip;
+    sample->pid = task ? task->id : 0;
+    sample->user = (regs->cs & 0x3) == 0x3;
+    /* User stacks may not be mapped, only walk kernel frames. */
+    sample->depth = sample->user ? 0 : backtrace(regs->ebp, sample->stack);
+}
+
+u64int profile_deadline(void)
+{
+    profile_ring_t *ring = &rings[cpu_index()];
+    if (!profiling || !ring->samples)
+        return 0;
+    return ring->next;
+}
+
+/*
+ * Write one sample as a line "S cpu pid mode eip ret...", numbers in
+ * hexadecimal.
+ */
+static void dump_sample(u32int cpu, profile_sample_t *sample)
+{
+    serial_write("S ");
+    serial_write_hex(cpu);
+    serial_put(' ');
+    serial_write_hex(sample->pid);
+    serial_write(sample->user ? " u " : " k ");
+    serial_write_hex(sample->eip);
+    u32int i;
+    for (i = 0; i < sample->depth; ++i) {
+        serial_put(' ');
+        serial_write_hex(sample->stack[i]);
+    }
+    serial_put('\n');
+}
+
+void profile_dump(void)
+{
+    serial_write("@profile ");
+    serial_write_hex(profile_hz);
+    serial_put('\n');
+
+    u32int i, j;
+    for (i = 0; i < MAX_CPUS; ++i) {
+        profile_ring_t *ring = &rings[i];
+        /* Oldest sample first. */
+        for (j = ring->lost; j < ring->count; ++j)
+            dump_sample(i, &ring->samples[j % PROFILE_SAMPLES]);
+        if (ring->lost) {
+            serial_write("L ");
+            serial_write_hex(i);
+            serial_put(' ');
+            serial_write_hex(ring->lost);
+            serial_put('\n');
+        }
+    }
+    serial_write("@end\n");
+}
+
+int profile(u32int hz)
+{
+    if (hz > PROFILE_MAX_HZ)
+        return -EINVAL;
+    if (hz) {
+        profile_start(hz);
+    } else {
+        profile_stop();
+        profile_dump();
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file    profile.h
+ *
+ * Defines the interface to the sampling profiler.
+ *
+ * While the profiler runs, the timer interrupt of every processor records
+ * where it interrupted the code: the instruction pointer, a short kernel
+ * backtrace, the task and the privilege level. Samples are kept in a ring
+ * per processor, which keeps the latest #PROFILE_SAMPLES of them and counts
+ * the older ones as lost. They are written to the serial port by
+ * profile_dump(), in a format read by `tools/profile-report`.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+#include "isr.h"
+
+/** Number of samples kept for every processor, a power of two. */
+#define PROFILE_SAMPLES     1024
+
+/** Highest sampling rate per processor. In tickless mode every sample
+ * takes a timer interrupt of its own. */
+#define PROFILE_MAX_HZ      10000
+
+/** Number of return addresses recorded for kernel samples. */
+#define PROFILE_DEPTH       6
+
+/** One sample of the profiler. */
+typedef struct {
+    /** Interrupted instruction. */
+    u32int eip;
+    /** Return addresses of the calling functions, innermost first. */
+    u32int stack[PROFILE_DEPTH];
+    /** Process ID of the interrupted task. */
+    u16int pid;
+    /** Number of valid entries in stack. */
+    u8int depth;
+    /** Nonzero if the processor was in user mode. */
+    u8int user;
+} profile_sample_t;
+
+/**
+ * Start sampling on all processors. Any samples taken before are thrown
+ * away.
+ *
+ * @param hz    sampling rate per processor, it can not exceed the tick
+ *              rate unless the timers are tickless, and is cut to
+ *              #PROFILE_MAX_HZ
+ */
+void profile_start(u32int hz);
+
+/**
+ * Stop sampling.
+ */
+void profile_stop(void);
+
+/**
+ * Write all samples to the serial port.
+ */
+void profile_dump(void);
+
+/**
+ * Take a sample if it is due on the executing processor. Called by the
+ * timer interrupt.
+ *
+ * @param regs  registers of the interrupted code
+ */
+void profile_tick(registers_t *regs);
+
+/**
+ * Get the time when the executing processor should take its next sample.
+ *
+ * @return time in nanoseconds as returned by ktime_ns(), or zero when
+ *         not profiling
+ */
+u64int profile_deadline(void);
+
+/**
+ * Control the profiler from user space: a nonzero rate starts it, zero
+ * stops it and dumps the samples.
+ *
+ * @param hz    sampling rate per processor, at most #PROFILE_MAX_HZ
+ * @return zero on success, -EINVAL if the rate is too high
+ */
+int profile(u32int hz);
+
+#endif /* end of include guard: PROFILE_H */
@@ -0,0 +1,62 @@
+/*
+ * serial.c -- Defines output to the first serial port.
+ */
+
+#include "serial.h"
+
+#define COM1            0x3F8
+
+/* Register offsets from the base port. With DLAB set in the line control
+ * register, the first two registers hold the baud rate divisor. */
+#define SERIAL_DATA     0
+#define SERIAL_IER      1
+#define SERIAL_FCR      2
+#define SERIAL_LCR      3
+#define SERIAL_MCR      4
+#define SERIAL_LSR      5
+
+#define LCR_8N1         0x03
+#define LCR_DLAB        0x80
+#define FCR_ENABLE      0xC7    /* Enable and clear FIFOs, 14 byte level */
+#define MCR_DTR_RTS     0x03
+#define LSR_THR_EMPTY   0x20
+
+/* Divisor of the 115200 Hz base clock. */
+#define BAUD_DIVISOR    1
+
+void init_serial(void)
+{
+    outb(COM1 + SERIAL_IER, 0x00);      /* No interrupts */
+    outb(COM1 + SERIAL_LCR, LCR_DLAB);
+    outb(COM1 + SERIAL_DATA, BAUD_DIVISOR & 0xFF);
+    outb(COM1 + SERIAL_IER, (BAUD_DIVISOR >> 8) & 0xFF);
+    outb(COM1 + SERIAL_LCR, LCR_8N1);
+    outb(COM1 + SERIAL_FCR, FCR_ENABLE);
+    outb(COM1 + SERIAL_MCR, MCR_DTR_RTS);
+}
+
+void serial_put(char c)
+{
+    while (!(inb(COM1 + SERIAL_LSR) & LSR_THR_EMPTY))
+        asm volatile ("pause");
+    outb(COM1 + SERIAL_DATA, c);
+}
+
+void serial_write(const char *s)
+{
+    while (*s)
+        serial_put(*s++);
+}
+
+void serial_write_hex(u32int n)
+{
+    int shift;
+    int started = 0;
+    for (shift = 28; shift >= 0; shift -= 4) {
+        u32int digit = (n >> shift) & 0xF;
+        if (!digit && !started && shift)
+            continue;
+        started = 1;
+        serial_put("0123456789abcdef"[digit]);
+    }
+}
@@ -0,0 +1,42 @@
+/**
+ * @file    serial.h
+ *
+ * Defines the interface to the first serial port.
+ *
+ * The port is used for output that has to be collected on the host, such
+ * as profiles. Run Qemu with `-serial file:serial.log` to capture it.
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "common.h"
+
+/**
+ * Initialise COM1 to 115200 baud, 8 data bits, no parity and one stop bit.
+ */
+void init_serial(void);
+
+/**
+ * Write a single character to the serial port.
+ *
+ * @param c character to write
+ */
+void serial_put(char c);
+
+/**
+ * Write a zero-terminated string to the serial port.
+ *
+ * @param s string to be written
+ */
+void serial_write(const char *s);
+
+/**
+ * Write a number to the serial port in hexadecimal system, without any
+ * prefix.
+ *
+ * @param n number to be written
+ */
+void serial_write_hex(u32int n);
+
+#endif /* end of include guard: SERIAL_H */
@@ -0,0 +1,68 @@
+;
+; smp-boot.s -- Entry point of application processors.
+;
+; An application processor starts in real mode at the address given by the
+; STARTUP IPI. initialise_smp() copies the code between ap_trampoline and
+; ap_trampoline_end to AP_BASE, fills in ap_cr3 and ap_stack and wakes the
+; processor up. The code switches to protected mode, enables paging with
+; the kernel page directory and calls ap_main().
+;
+
+AP_BASE equ 0x7000                  ; Must match AP_TRAMPOLINE in smp.c
+
+; Address of a label in the copy of the trampoline.
+%define REL(x) (AP_BASE + (x) - ap_trampoline)
+
+[GLOBAL ap_trampoline]
+[GLOBAL ap_trampoline_end]
+[GLOBAL ap_cr3]
+[GLOBAL ap_stack]
+[EXTERN ap_main]
+
+[BITS 16]
+ap_trampoline:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [REL(ap_gdt_ptr)]          ; Load a temporary flat GDT
+
+    mov eax, cr0
+    or eax, 1                       ; Enable protected mode
+    mov cr0, eax
+    jmp dword 0x08:REL(ap_protected)
+
+[BITS 32]
+ap_protected:
+    mov ax, 0x10                    ; Kernel data segment
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [REL(ap_cr3)]          ; Use the page directory of the kernel
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000              ; Enable paging
+    mov cr0, eax
+
+    mov esp, [REL(ap_stack)]
+    mov eax, ap_main                ; Absolute jump out of the copy
+    call eax
+    jmp $                           ; ap_main() never returns
+
+align 8
+ap_gdt:
+    dq 0                            ; Null segment
+    dq 0x00CF9A000000FFFF           ; Code segment
+    dq 0x00CF92000000FFFF           ; Data segment
+ap_gdt_ptr:
+    dw ap_gdt_ptr - ap_gdt - 1
+    dd REL(ap_gdt)
+
+ap_cr3:
+    dd 0                            ; Physical address of page directory
+ap_stack:
+    dd 0                            ; Initial stack pointer
+ap_trampoline_end:
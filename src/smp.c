@@ -0,0 +1,375 @@
+/*
+ * smp.c -- Finds the processors in the MP tables and starts the application
+ *          processors.
+ */
+
+#include <string.h>
+
+#include "apic.h"
+#include "ioapic.h"
+#include "isr.h"
+#include "kstack.h"
+#include "monitor.h"
+#include "smp.h"
+#include "task.h"
+#include "timer.h"
+
+/* Where the real mode startup code is copied. Must be page aligned, below
+ * 1 MB and match AP_BASE in smp-boot.s. */
+#define AP_TRAMPOLINE   0x7000
+
+/** MP floating pointer structure. */
+typedef struct {
+    /** Signature "_MP_". */
+    char signature[4];
+    /** Physical address of the configuration table. */
+    u32int config;
+    /** Length in 16 byte units. */
+    u8int length;
+    /** Version of the specification. */
+    u8int revision;
+    /** All bytes must sum to zero. */
+    u8int checksum;
+    /** Feature information bytes. */
+    u8int features[5];
+} PACKED mp_float_t;
+
+/** MP configuration table header. */
+typedef struct {
+    /** Signature "PCMP". */
+    char signature[4];
+    /** Length of the table including the header. */
+    u16int length;
+    /** Version of the specification. */
+    u8int revision;
+    /** All bytes must sum to zero. */
+    u8int checksum;
+    /** Manufacturer of the system. */
+    char oem[8];
+    /** Product family. */
+    char product[12];
+    /** Physical address of OEM specific table. */
+    u32int oem_table;
+    /** Size of OEM specific table. */
+    u16int oem_length;
+    /** Number of entries following the header. */
+    u16int entries;
+    /** Physical address of the Local APICs. */
+    u32int lapic_addr;
+    /** Length of the extended entries. */
+    u16int ext_length;
+    /** Checksum of the extended entries. */
+    u8int ext_checksum;
+    /** Reserved. */
+    u8int reserved;
+} PACKED mp_config_t;
+
+/** MP configuration table entry describing a processor. */
+typedef struct {
+    /** Entry type, always MP_PROCESSOR. */
+    u8int type;
+    /** ID of the Local APIC. */
+    u8int apic_id;
+    /** Version of the Local APIC. */
+    u8int apic_version;
+    /** Bit 0: enabled, bit 1: bootstrap processor. */
+    u8int flags;
+    /** Stepping, model and family. */
+    u32int signature;
+    /** CPUID feature flags. */
+    u32int features;
+    /** Reserved. */
+    u32int reserved[2];
+} PACKED mp_processor_t;
+
+/** MP configuration table entry describing a bus. */
+typedef struct {
+    /** Entry type, always MP_BUS. */
+    u8int type;
+    /** ID of the bus. */
+    u8int bus_id;
+    /** Type of the bus, padded with spaces. */
+    char bus_type[6];
+} PACKED mp_bus_t;
+
+/** MP configuration table entry describing an I/O APIC. */
+typedef struct {
+    /** Entry type, always MP_IOAPIC. */
+    u8int type;
+    /** ID of the I/O APIC. */
+    u8int apic_id;
+    /** Version of the I/O APIC. */
+    u8int apic_version;
+    /** Bit 0: enabled. */
+    u8int flags;
+    /** Physical address of the registers. */
+    u32int addr;
+} PACKED mp_ioapic_t;
+
+/** MP configuration table entry describing an interrupt assignment. */
+typedef struct {
+    /** Entry type, always MP_IOINTR. */
+    u8int type;
+    /** Kind of the interrupt, MP_INT for vectored ones. */
+    u8int int_type;
+    /** Polarity and trigger mode. */
+    u16int flags;
+    /** Bus the interrupt comes from. */
+    u8int src_bus;
+    /** Interrupt line on that bus. */
+    u8int src_irq;
+    /** ID of the I/O APIC it is connected to. */
+    u8int dst_apic;
+    /** Input of the I/O APIC. */
+    u8int dst_pin;
+} PACKED mp_iointr_t;
+
+#define MP_PROCESSOR        0
+#define MP_BUS              1
+#define MP_IOAPIC           2
+#define MP_IOINTR           3
+#define MP_PROCESSOR_EN     0x01
+#define MP_PROCESSOR_BSP    0x02
+#define MP_IOAPIC_EN        0x01
+#define MP_INT              0
+
+/* Defined in smp-boot.s */
+extern u8int ap_trampoline[];
+extern u8int ap_trampoline_end[];
+extern u8int ap_cr3[];
+extern u8int ap_stack[];
+
+cpu_t cpus[MAX_CPUS];
+u32int ncpus = 1;
+
+/* Number of processors found in the MP tables. */
+static u32int cpus_found = 1;
+
+/* Index of the processor currently being started. */
+static volatile u32int ap_booting;
+/* Stack given to the processor currently being started. */
+static u32int ap_boot_stack;
+
+/*
+ * Sum all bytes in given memory area.
+ */
+static u8int checksum(void *addr, u32int len)
+{
+    u8int sum = 0, *p = addr;
+    while (len--)
+        sum += *p++;
+    return sum;
+}
+
+/*
+ * Check that the memory at addr starts with given 4 byte signature.
+ */
+static int has_signature(void *addr, const char *sig)
+{
+    char *p = addr;
+    return p[0] == sig[0] && p[1] == sig[1] && p[2] == sig[2] && p[3] == sig[3];
+}
+
+/*
+ * Look for the MP floating pointer structure in len bytes at addr.
+ */
+static mp_float_t *mp_search(u32int addr, u32int len)
+{
+    u32int end = addr + len;
+    for ( ; addr < end; addr += sizeof(mp_float_t)) {
+        if (has_signature((void *) addr, "_MP_")
+                && !checksum((void *) addr, sizeof(mp_float_t)))
+            return (mp_float_t *) addr;
+    }
+    return 0;
+}
+
+/*
+ * The floating pointer is either in the first kilobyte of the Extended
+ * BIOS Data Area, in the last kilobyte of base memory, or in the BIOS ROM.
+ */
+static mp_float_t *mp_find(void)
+{
+    mp_float_t *mp;
+    u32int ebda = *((u16int *) 0x40E) << 4;
+    if (ebda && (mp = mp_search(ebda, 1024)))
+        return mp;
+    u32int base_mem = *((u16int *) 0x413) * 1024;
+    if ((mp = mp_search(base_mem - 1024, 1024)))
+        return mp;
+    return mp_search(0xF0000, 0x10000);
+}
+
+/*
+ * Record an interrupt assignment of an ISA interrupt.
+ */
+static void mp_iointr(mp_iointr_t *intr, int isa_bus)
+{
+    if (intr->int_type == MP_INT && intr->src_bus == isa_bus)
+        ioapic_add_isa_irq(intr->src_irq, intr->dst_pin, intr->flags);
+}
+
+/*
+ * Walk the MP configuration table and record every enabled application
+ * processor, the I/O APIC and where the ISA interrupts are connected.
+ */
+static void mp_parse(void)
+{
+    mp_float_t *mp = mp_find();
+    if (!mp || !mp->config)
+        return;
+
+    mp_config_t *conf = (mp_config_t *) mp->config;
+    if (!has_signature(conf, "PCMP") || checksum(conf, conf->length))
+        return;
+
+    /* Bus entries precede interrupt assignments in the table. */
+    int isa_bus = -1;
+    u8int *entry = (u8int *) (conf + 1);
+    u16int i;
+    for (i = 0; i < conf->entries; ++i) {
+        if (*entry == MP_BUS) {
+            mp_bus_t *bus = (mp_bus_t *) entry;
+            if (bus->bus_type[0] == 'I' && bus->bus_type[1] == 'S' &&
+                    bus->bus_type[2] == 'A' && bus->bus_type[3] == ' ')
+                isa_bus = bus->bus_id;
+        } else if (*entry == MP_IOAPIC) {
+            mp_ioapic_t *io = (mp_ioapic_t *) entry;
+            if (io->flags & MP_IOAPIC_EN)
+                ioapic_add(io->apic_id, io->addr);
+        } else if (*entry == MP_IOINTR) {
+            mp_iointr((mp_iointr_t *) entry, isa_bus);
+        }
+        if (*entry != MP_PROCESSOR) {
+            /* All other entries are 8 bytes long. */
+            entry += 8;
+            continue;
+        }
+        mp_processor_t *proc = (mp_processor_t *) entry;
+        entry += sizeof(mp_processor_t);
+
+        if (!(proc->flags & MP_PROCESSOR_EN) || proc->flags & MP_PROCESSOR_BSP)
+            continue;
+        if (cpus_found == MAX_CPUS) {
+            monitor_print("SMP: ignoring processor %u\n", proc->apic_id);
+            continue;
+        }
+        cpus[cpus_found].index = cpus_found;
+        cpus[cpus_found].apic_id = proc->apic_id;
+        cpus_found++;
+    }
+}
+
+/*
+ * Busy wait for given number of timer ticks.
+ */
+static void wait_ticks(u32int n)
+{
+    u32int start = tick;
+    while (tick - start < n)
+        asm volatile ("pause");
+}
+
+/*
+ * Busy wait for roughly given number of microseconds. Each write to the
+ * POST diagnostic port takes about a microsecond.
+ */
+static void io_delay(u32int usec)
+{
+    while (usec--)
+        outb(0x80, 0);
+}
+
+/*
+ * First C code executed by an application processor.
+ */
+void ap_main(void)
+{
+    cpu_t *cpu = &cpus[ap_booting];
+
+    /* A processor given up on by start_ap() was sent INIT, so it should
+     * never get here. If it did anyway, the stack and the slot are not its
+     * own: stop before touching them. */
+    if (cpu->apic_id != lapic_id())
+        for (;;)
+            asm volatile ("cli; hlt");
+
+    init_ap_descriptor_tables(cpu->index);
+    init_ap_lapic();
+    initialise_tasking_ap(ap_boot_stack);
+    lapic_timer_start();
+    cpu->online = 1;
+
+    /* Become the idle task. */
+    cpu_idle();
+}
+
+/*
+ * Start one application processor using the INIT-SIPI-SIPI sequence.
+ */
+static void start_ap(cpu_t *cpu)
+{
+    u32int stack = kstack_alloc();
+    *(u32int *) (AP_TRAMPOLINE + (ap_cr3 - ap_trampoline)) =
+        current_directory->physicalAddr;
+    *(u32int *) (AP_TRAMPOLINE + (ap_stack - ap_trampoline)) =
+        stack + KERNEL_STACK_SIZE;
+    ap_boot_stack = stack;
+    ap_booting = cpu->index;
+    cpu->directory = current_directory;
+
+    lapic_send_init(cpu->apic_id);
+    wait_ticks(1);
+
+    int attempt;
+    for (attempt = 0; attempt < 2 && !cpu->online; ++attempt) {
+        lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE / 0x1000);
+        io_delay(200);
+    }
+
+    /* Give the processor some time to come up. */
+    u32int start = tick;
+    while (!cpu->online && tick - start < 10)
+        asm volatile ("pause");
+
+    if (cpu->online) {
+        ncpus++;
+    } else {
+        /* Put the processor back to waiting for a startup IPI, so it can
+         * not run the trampoline set up for the next one. Its stack is
+         * never freed and its slot stays offline, in case it got far
+         * enough to use them. */
+        lapic_send_init(cpu->apic_id);
+        monitor_print("SMP: processor %u did not start\n", cpu->apic_id);
+    }
+}
+
+void initialise_smp(void)
+{
+    u32int i;
+    for (i = 0; i < MAX_CPUS; ++i)
+        spin_init(&cpus[i].lock, "runqueue");
+
+    cpus[0].index = 0;
+    cpus[0].online = 1;
+
+    if (!init_lapic())
+        return;
+    cpus[0].apic_id = lapic_id();
+
+    mp_parse();
+
+    /* Device interrupts go through the I/O APIC from now on, if any. */
+    init_ioapic();
+
+    if (cpus_found == 1)
+        return;
+
+    memcpy((void *) AP_TRAMPOLINE, ap_trampoline,
+            ap_trampoline_end - ap_trampoline);
+
+    for (i = 1; i < cpus_found; ++i)
+        start_ap(&cpus[i]);
+
+    monitor_print("SMP: %u processors running\n", ncpus);
+}
@@ -0,0 +1,75 @@
+/**
+ * @file    smp.h
+ *
+ * Defines per-processor data and the interface for starting application
+ * processors.
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include "common.h"
+#include "descriptor-tables.h"
+#include "paging.h"
+#include "spinlock.h"
+
+/** Maximum number of supported processors. */
+#define MAX_CPUS    8
+
+struct task;
+struct tasklet;
+
+/** Data private to one processor. */
+typedef struct {
+    /** Index of this processor in cpus[]. */
+    u32int index;
+    /** ID of the Local APIC of this processor. */
+    u8int apic_id;
+    /** Set by the processor once it is fully initialised. */
+    volatile u8int online;
+    /** Task currently running on this processor. */
+    struct task *current;
+    /** Linked list of tasks owned by this processor. */
+    struct task *ready_queue;
+    /** Task run when there is nothing else to do. */
+    struct task *idle_task;
+    /** Kernel threads that exited on this processor. */
+    struct task *dead_tasks;
+    /** Number of tasks in ready_queue. */
+    u32int nr_tasks;
+    /** Protects ready_queue and nr_tasks. */
+    spinlock_t lock;
+    /** Page directory loaded on this processor. */
+    page_directory_t *directory;
+    /** Value of the tick when time was last charged to a task. */
+    u32int last_tick;
+    /** Bitmap of softirqs waiting to run. */
+    volatile u32int softirq_pending;
+    /** Set while softirqs run. */
+    u32int in_softirq;
+    /** Tasklets waiting to run. */
+    struct tasklet *tasklets;
+    /** Set by interrupt handlers which want the next task to run once the
+     * interrupt is handled. */
+    u32int need_resched;
+} cpu_t;
+
+/** Data of all processors. */
+extern cpu_t cpus[MAX_CPUS];
+
+/** Number of processors running. */
+extern u32int ncpus;
+
+/** Get data of the executing processor. */
+#define this_cpu() (&cpus[cpu_index()])
+
+/** The page directory loaded on the executing processor. */
+#define current_directory (this_cpu()->directory)
+
+/**
+ * Find all processors and start the application processors. Paging and
+ * the timer must already be running.
+ */
+void initialise_smp(void);
+
+#endif /* end of include guard: SMP_H */
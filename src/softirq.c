@@ -0,0 +1,120 @@
+/*
+ * softirq.c -- Defines softirqs and tasklets, the deferred parts of
+ *              interrupt handling.
+ */
+
+#include "smp.h"
+#include "softirq.h"
+#include "timer.h"
+
+/* Softirqs raised again while running are restarted at most this many
+ * times, the rest waits for the next timer interrupt. */
+#define MAX_RESTART     10
+
+static softirq_fn_t softirq_vec[NR_SOFTIRQS];
+
+void open_softirq(u32int nr, softirq_fn_t fn)
+{
+    softirq_vec[nr] = fn;
+}
+
+void raise_softirq(u32int nr)
+{
+    u32int flags = irq_save();
+    this_cpu()->softirq_pending |= 1 << nr;
+    irq_restore(flags);
+}
+
+void do_softirq(void)
+{
+    cpu_t *cpu = this_cpu();
+
+    /* An interrupt that came while softirqs run leaves its work to the
+     * loop below. */
+    if (cpu->in_softirq || !cpu->softirq_pending)
+        return;
+    cpu->in_softirq = 1;
+
+    u32int restart = MAX_RESTART;
+    u32int pending;
+    while ((pending = cpu->softirq_pending) && restart--) {
+        cpu->softirq_pending = 0;
+        asm volatile ("sti");
+
+        u32int nr;
+        for (nr = 0; pending; ++nr, pending >>= 1) {
+            if ((pending & 1) && softirq_vec[nr])
+                softirq_vec[nr]();
+        }
+
+        asm volatile ("cli");
+    }
+
+    cpu->in_softirq = 0;
+
+    /* A tickless processor may have no timer interrupt coming, make sure
+     * the work left over is not stranded. */
+    if (cpu->softirq_pending)
+        timer_kick(cpu);
+}
+
+void tasklet_init(tasklet_t *tasklet, tasklet_fn_t fn, void *arg)
+{
+    tasklet->next = 0;
+    tasklet->fn = fn;
+    tasklet->arg = arg;
+    tasklet->scheduled = 0;
+    tasklet->running = 0;
+}
+
+void tasklet_schedule(tasklet_t *tasklet)
+{
+    u32int flags = irq_save();
+    /* Processors may race to schedule the same tasklet, only the one
+     * setting the flag queues it. */
+    if (!xchg(&tasklet->scheduled, 1)) {
+        cpu_t *cpu = this_cpu();
+        tasklet->next = cpu->tasklets;
+        cpu->tasklets = tasklet;
+        cpu->softirq_pending |= 1 << TASKLET_SOFTIRQ;
+    }
+    irq_restore(flags);
+}
+
+/*
+ * Run all tasklets scheduled on the executing processor.
+ */
+static void tasklet_action(void)
+{
+    u32int flags = irq_save();
+    cpu_t *cpu = this_cpu();
+    tasklet_t *list = cpu->tasklets;
+    cpu->tasklets = 0;
+    irq_restore(flags);
+
+    while (list) {
+        tasklet_t *tasklet = list;
+        list = list->next;
+
+        /* A tasklet scheduled here while it runs on another processor
+         * must not run twice at once: put it back for a later pass. */
+        if (xchg(&tasklet->running, 1)) {
+            flags = irq_save();
+            tasklet->next = cpu->tasklets;
+            cpu->tasklets = tasklet;
+            cpu->softirq_pending |= 1 << TASKLET_SOFTIRQ;
+            irq_restore(flags);
+            continue;
+        }
+
+        /* Clear the flag first, so the tasklet can schedule itself again. */
+        tasklet->scheduled = 0;
+        tasklet->fn(tasklet->arg);
+        tasklet->running = 0;
+    }
+}
+
+void init_softirq(void)
+{
+    open_softirq(TASKLET_SOFTIRQ, &tasklet_action);
+}
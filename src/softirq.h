@@ -0,0 +1,86 @@
+/**
+ * @file    softirq.h
+ *
+ * Defines the interface to deferred interrupt work.
+ *
+ * Interrupt handlers should only do what can not wait, and defer the rest
+ * by raising a softirq or scheduling a tasklet. Pending work runs on the
+ * same processor when irq_handler() is done with the interrupt, after it
+ * was acknowledged and with interrupts enabled. Deferred work must not
+ * sleep.
+ */
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include "common.h"
+
+#define TIMER_SOFTIRQ       0   /**< Runs expired kernel timers */
+#define TASKLET_SOFTIRQ     1   /**< Runs scheduled tasklets */
+#define NR_SOFTIRQS         2   /**< Number of softirqs */
+
+/** Handler of a softirq. */
+typedef void (*softirq_fn_t)(void);
+
+/** Function run by a tasklet. */
+typedef void (*tasklet_fn_t)(void *arg);
+
+/** A piece of deferred work. The structure is owned by the caller. */
+typedef struct tasklet {
+    /** Next tasklet scheduled on the same processor. */
+    struct tasklet *next;
+    /** Function to run. */
+    tasklet_fn_t fn;
+    /** Argument passed to fn. */
+    void *arg;
+    /** Nonzero while the tasklet waits to run. */
+    volatile u32int scheduled;
+    /** Nonzero while a processor runs the tasklet. */
+    volatile u32int running;
+} tasklet_t;
+
+/**
+ * Set the handler of a softirq.
+ *
+ * @param nr    number of the softirq
+ * @param fn    function to run when the softirq is raised
+ */
+void open_softirq(u32int nr, softirq_fn_t fn);
+
+/**
+ * Mark a softirq pending on the executing processor.
+ *
+ * @param nr    number of the softirq
+ */
+void raise_softirq(u32int nr);
+
+/**
+ * Run pending softirqs of the executing processor. Called by irq_handler()
+ * with interrupts disabled, which are enabled while the handlers run.
+ */
+void do_softirq(void);
+
+/**
+ * Prepare a tasklet.
+ *
+ * @param tasklet   tasklet to initialise
+ * @param fn        function to run
+ * @param arg       argument passed to fn
+ */
+void tasklet_init(tasklet_t *tasklet, tasklet_fn_t fn, void *arg);
+
+/**
+ * Run a tasklet once on the executing processor. Scheduling a tasklet that
+ * has not run yet does nothing, so one run may serve several requests. A
+ * tasklet never runs on two processors at once.
+ *
+ * @param tasklet   tasklet to run
+ */
+void tasklet_schedule(tasklet_t *tasklet);
+
+/**
+ * Register the tasklet softirq.
+ */
+void init_softirq(void);
+
+#endif /* end of include guard: SOFTIRQ_H */
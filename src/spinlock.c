@@ -0,0 +1,121 @@
+/*
+ * spinlock.c -- Defines a simple spinning lock.
+ */
+
+#include "monitor.h"
+#include "spinlock.h"
+
+u32int xchg(volatile u32int *addr, u32int value)
+{
+    asm volatile ("lock; xchgl %0, %1"
+                  : "+m" (*addr), "+r" (value) : : "memory");
+    return value;
+}
+
+#ifdef LOCK_STATS
+/* All locks that were acquired at least once. */
+static spinlock_t *all_locks = 0;
+/* Protects all_locks. It can not be a spinlock_t itself. */
+static volatile u32int all_locks_lock = 0;
+
+/*
+ * Record an acquisition of a lock. Called with the lock held.
+ */
+static void acquired_stats(spinlock_t *lock, u32int spins)
+{
+    if (!lock->acquisitions) {
+        while (xchg(&all_locks_lock, 1))
+            asm volatile ("pause");
+        lock->next = all_locks;
+        all_locks = lock;
+        all_locks_lock = 0;
+    }
+    lock->acquisitions++;
+    lock->contended += spins;
+    lock->acquired_at = rdtsc();
+}
+
+void spin_release_stats(spinlock_t *lock)
+{
+    u64int held = rdtsc() - lock->acquired_at;
+    if (held > lock->max_hold)
+        lock->max_hold = held;
+}
+
+void lock_stats_dump(void)
+{
+    spinlock_t *lock;
+    for (lock = all_locks; lock; lock = lock->next) {
+        monitor_print("%s: acquired %u, contended spins %u, max hold %u\n",
+                lock->name ? lock->name : "?", lock->acquisitions,
+                lock->contended, (u32int) lock->max_hold);
+    }
+}
+#else
+#define acquired_stats(lock, spins) do { } while (0)
+#endif
+
+void spin_init(spinlock_t *lock, const char *name)
+{
+    lock->locked = 0;
+#ifdef LOCK_STATS
+    lock->name = name;
+    lock->acquisitions = lock->contended = 0;
+    lock->max_hold = lock->acquired_at = 0;
+    lock->next = 0;
+#endif
+}
+
+void spin_lock(spinlock_t *lock)
+{
+    u32int spins = 0;
+    while (xchg(&lock->locked, 1)) {
+        /* Wait with plain reads, so that we don't keep bouncing the cache
+         * line between processors. */
+        while (lock->locked) {
+            asm volatile ("pause");
+            spins++;
+        }
+    }
+    acquired_stats(lock, spins);
+}
+
+int spin_trylock(spinlock_t *lock)
+{
+    if (xchg(&lock->locked, 1))
+        return 0;
+    acquired_stats(lock, 0);
+    return 1;
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+    spin_release_stats(lock);
+    asm volatile ("" ::: "memory");
+    lock->locked = 0;
+}
+
+u32int irq_save(void)
+{
+    u32int flags;
+    asm volatile ("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+void irq_restore(u32int flags)
+{
+    asm volatile ("push %0; popf" : : "r" (flags) : "memory", "cc");
+}
+
+u32int spin_lock_irqsave(spinlock_t *lock)
+{
+    u32int flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t *lock, u32int flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
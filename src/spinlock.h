@@ -0,0 +1,137 @@
+/**
+ * @file    spinlock.h
+ *
+ * Defines a simple spinning lock for mutual exclusion between processors.
+ *
+ * When the kernel is built with `LOCK_STATS` defined (`make LOCK_STATS=1`),
+ * every lock counts its acquisitions, the spins spent waiting for it and
+ * the longest time it was held. Use lock_stats_dump() to print them.
+ */
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "common.h"
+
+/** A spinning lock. */
+typedef struct spinlock {
+    /** Nonzero if the lock is held. */
+    volatile u32int locked;
+#ifdef LOCK_STATS
+    /** Name printed by lock_stats_dump(). */
+    const char *name;
+    /** Number of times the lock was acquired. */
+    u32int acquisitions;
+    /** Number of spins spent waiting for the lock. */
+    u32int contended;
+    /** Longest time the lock was held, in cycles. */
+    u64int max_hold;
+    /** Time stamp of the last acquisition. */
+    u64int acquired_at;
+    /** Next lock in the list of locks with statistics. */
+    struct spinlock *next;
+#endif
+} spinlock_t;
+
+#ifdef LOCK_STATS
+#define SPINLOCK_INIT(name) { 0, name, 0, 0, 0, 0, 0 }
+#else
+/** Initializer for a statically allocated unlocked spinlock. The name is
+ * used only for statistics. */
+#define SPINLOCK_INIT(name) { 0 }
+#endif
+
+/**
+ * Initialise a lock to unlocked state.
+ *
+ * @param lock  lock to initialise
+ * @param name  name of the lock in statistics
+ */
+void spin_init(spinlock_t *lock, const char *name);
+
+/**
+ * Acquire a lock, spinning until it becomes available.
+ *
+ * The lock does not disable interrupts. If the lock is also taken from
+ * interrupt handlers, use spin_lock_irqsave() instead.
+ *
+ * @param lock  lock to acquire
+ */
+void spin_lock(spinlock_t *lock);
+
+/**
+ * Try to acquire a lock without spinning.
+ *
+ * @param lock  lock to acquire
+ * @return nonzero if the lock was acquired
+ */
+int spin_trylock(spinlock_t *lock);
+
+/**
+ * Release a lock acquired with spin_lock().
+ *
+ * @param lock  lock to release
+ */
+void spin_unlock(spinlock_t *lock);
+
+/**
+ * Atomically store a value and return the previous contents, with a full
+ * memory barrier.
+ *
+ * @param addr  word to write
+ * @param value value to store
+ * @return the previous value of the word
+ */
+u32int xchg(volatile u32int *addr, u32int value);
+
+/**
+ * Disable interrupts and return the previous state of EFLAGS. Calls can be
+ * nested, as long as each is paired with irq_restore().
+ *
+ * @return value to pass to irq_restore()
+ */
+u32int irq_save(void);
+
+/**
+ * Restore the interrupt state saved by irq_save().
+ *
+ * @param flags value returned by irq_save()
+ */
+void irq_restore(u32int flags);
+
+/**
+ * Disable interrupts and acquire a lock.
+ *
+ * @param lock  lock to acquire
+ * @return value to pass to spin_unlock_irqrestore()
+ */
+u32int spin_lock_irqsave(spinlock_t *lock);
+
+/**
+ * Release a lock and restore the interrupt state saved by
+ * spin_lock_irqsave().
+ *
+ * @param lock  lock to release
+ * @param flags value returned by spin_lock_irqsave()
+ */
+void spin_unlock_irqrestore(spinlock_t *lock, u32int flags);
+
+#ifdef LOCK_STATS
+/**
+ * Account the end of the current hold of a lock that is about to be
+ * released by other means than spin_unlock().
+ *
+ * @param lock  lock that is being released
+ */
+void spin_release_stats(spinlock_t *lock);
+
+/**
+ * Print statistics of all locks that were used so far.
+ */
+void lock_stats_dump(void);
+#else
+#define spin_release_stats(lock)    do { } while (0)
+#define lock_stats_dump()           do { } while (0)
+#endif
+
+#endif /* end of include guard: SPINLOCK_H */
@@ -3,55 +3,433 @@
  * Written for JamesM's kernel development tutorial.
  */
 
+#include <errno.h>
+#include <string.h>
+
 #include "isr.h"
 #include "syscall.h"
 
+#include "clock.h"
+#include "descriptor-tables.h"
+#include "fs.h"
 #include "monitor.h"
+#include "paging.h"
+#include "profile.h"
+#include "serial.h"
+#include "smp.h"
+#include "task.h"
+#include "uring.h"
+
+void syscall_handler(registers_t *regs);
+static void trace_record(task_t *, u32int, registers_t *, u64int);
+
+/* Defined in interrupt.s */
+extern void syscall_int80(void);
+extern void syscall_sysenter(void);
+
+void *syscall_entry = &syscall_int80;
+
+/*
+ * Checks of one argument, used by the thunks below. VAL takes anything,
+ * IN and OUT need the pointed to object to be readable or writable and
+ * STR needs a readable string. Pointers given by the kernel itself are
+ * trusted.
+ */
+#define FROM_USER(regs)     ((regs)->cs & 3)
+#define VAL(regs, a)        1
+#define IN(regs, a)         (!FROM_USER(regs) || user_range_ok(a, sizeof(*(a)), 0))
+#define OUT(regs, a)        (!FROM_USER(regs) || user_range_ok(a, sizeof(*(a)), 1))
+#define STR(regs, a)        (!FROM_USER(regs) || user_string_ok(a))
+
+/*
+ * Thunks take the arguments out of the saved registers, cast them to the
+ * types the implementation expects and check them. Each is given the type
+ * and the check of every argument in order.
+ */
+#define SYSCALL_THUNK0(fn) \
+    static int sys_##fn(registers_t *regs) \
+    { \
+        return fn(); \
+    }
+
+#define SYSCALL_THUNK1(fn,T1,C1) \
+    static int sys_##fn(registers_t *regs) \
+    { \
+        T1 a1 = (T1) regs->ebx; \
+        if (!C1(regs, a1)) \
+            return -EFAULT; \
+        return fn(a1); \
+    }
+
+#define SYSCALL_THUNK2(fn,T1,C1,T2,C2) \
+    static int sys_##fn(registers_t *regs) \
+    { \
+        T1 a1 = (T1) regs->ebx; \
+        T2 a2 = (T2) regs->ecx; \
+        if (!C1(regs, a1) || !C2(regs, a2)) \
+            return -EFAULT; \
+        return fn(a1, a2); \
+    }
+
+#define SYSCALL_THUNK3(fn,T1,C1,T2,C2,T3,C3) \
+    static int sys_##fn(registers_t *regs) \
+    { \
+        T1 a1 = (T1) regs->ebx; \
+        T2 a2 = (T2) regs->ecx; \
+        T3 a3 = (T3) regs->edx; \
+        if (!C1(regs, a1) || !C2(regs, a2) || !C3(regs, a3)) \
+            return -EFAULT; \
+        return fn(a1, a2, a3); \
+    }
+
+#define SYSCALL_THUNK4(fn,T1,C1,T2,C2,T3,C3,T4,C4) \
+    static int sys_##fn(registers_t *regs) \
+    { \
+        T1 a1 = (T1) regs->ebx; \
+        T2 a2 = (T2) regs->ecx; \
+        T3 a3 = (T3) regs->edx; \
+        T4 a4 = (T4) regs->esi; \
+        if (!C1(regs, a1) || !C2(regs, a2) || !C3(regs, a3) || \
+                !C4(regs, a4)) \
+            return -EFAULT; \
+        return fn(a1, a2, a3, a4); \
+    }
+
+#define SYSCALL_THUNK5(fn,T1,C1,T2,C2,T3,C3,T4,C4,T5,C5) \
+    static int sys_##fn(registers_t *regs) \
+    { \
+        T1 a1 = (T1) regs->ebx; \
+        T2 a2 = (T2) regs->ecx; \
+        T3 a3 = (T3) regs->edx; \
+        T4 a4 = (T4) regs->esi; \
+        T5 a5 = (T5) regs->edi; \
+        if (!C1(regs, a1) || !C2(regs, a2) || !C3(regs, a3) || \
+                !C4(regs, a4) || !C5(regs, a5)) \
+            return -EFAULT; \
+        return fn(a1, a2, a3, a4, a5); \
+    }
+
+/* monitor_write() returns nothing, so it needs its own thunk. */
+static int sys_monitor_write(registers_t *regs)
+{
+    const char *c = (const char *) regs->ebx;
+    if (!STR(regs, c))
+        return -EFAULT;
+    monitor_write(c);
+    return 0;
+}
+
+/*
+ * Copy an I/O vector of the caller and check its buffers, which are read
+ * by the kernel if `write` is zero and written otherwise.
+ */
+static int copy_iovec(registers_t *regs, const iovec_t *user_iov,
+                      u32int iovcnt, iovec_t *iov, int write)
+{
+    if (iovcnt > IOV_MAX)
+        return -EINVAL;
+    if (FROM_USER(regs)
+            && !user_range_ok(user_iov, iovcnt * sizeof(iovec_t), 0))
+        return -EFAULT;
+    memcpy(iov, user_iov, iovcnt * sizeof(iovec_t));
+
+    u32int i;
+    for (i = 0; i < iovcnt; ++i) {
+        if (FROM_USER(regs) && !user_range_ok(iov[i].base, iov[i].len, write))
+            return -EFAULT;
+    }
+    return 0;
+}
+
+/*
+ * Vectored transfer on the file of given name in the root directory.
+ * Arguments are the name, the offset in the file, the vector and its
+ * length.
+ */
+static int sys_rwv(registers_t *regs, int write)
+{
+    const char *path = (const char *) regs->ebx;
+    iovec_t iov[IOV_MAX];
+    int err;
+
+    if (!STR(regs, path))
+        return -EFAULT;
+    err = copy_iovec(regs, (const iovec_t *) regs->edx, regs->esi, iov, !write);
+    if (err)
+        return err;
+
+    fs_node_t *node = fs_root ? lookup_fs(fs_root, path) : 0;
+    if (!node)
+        return -ENOENT;
+    if (write)
+        return writev_fs(node, regs->ecx, iov, regs->esi);
+    return readv_fs(node, regs->ecx, iov, regs->esi);
+}
+
+static int sys_readv(registers_t *regs)
+{
+    return sys_rwv(regs, 0);
+}
+
+static int sys_writev(registers_t *regs)
+{
+    return sys_rwv(regs, 1);
+}
+
+/* Write several buffers to the monitor, each of given length. */
+static int sys_monitor_writev(registers_t *regs)
+{
+    iovec_t iov[IOV_MAX];
+    u32int iovcnt = regs->ecx, total = 0, i, j;
+    int err = copy_iovec(regs, (const iovec_t *) regs->ebx, iovcnt, iov, 0);
+    if (err)
+        return err;
+
+    for (i = 0; i < iovcnt; ++i) {
+        const char *c = iov[i].base;
+        for (j = 0; j < iov[i].len; ++j)
+            monitor_put(c[j]);
+        total += iov[i].len;
+    }
+    return total;
+}
 
-static void syscall_handler(registers_t *regs);
+SYSCALL_THUNK2(getrusage, int, VAL, rusage_t *, OUT)
+SYSCALL_THUNK1(gettime, u64int *, OUT)
+SYSCALL_THUNK1(profile, u32int, VAL)
+SYSCALL_THUNK0(dump_interrupts)
+SYSCALL_THUNK0(getpid)
+SYSCALL_THUNK3(uring_setup, u32int, VAL, u32int, VAL, uring_shared_t **, OUT)
+SYSCALL_THUNK1(uring_enter, u32int, VAL)
+SYSCALL_THUNK2(trace_task, int, VAL, u32int, VAL)
+SYSCALL_THUNK1(trace_read, syscall_trace_t *, OUT)
+SYSCALL_THUNK0(dump_syscalls)
 
-static void *syscalls[2] = {
-    &monitor_write,
+#define SYSCALL(fn,nargs)   { &sys_##fn, nargs, #fn }
+
+/* Indexed by the number of the call, which must match DEFN_SYSCALL in
+ * syscall.h. */
+static const syscall_t syscalls[] = {
+    SYSCALL(monitor_write, 1),
+    SYSCALL(getrusage, 2),
+    SYSCALL(gettime, 1),
+    SYSCALL(profile, 1),
+    SYSCALL(dump_interrupts, 0),
+    SYSCALL(getpid, 0),
+    SYSCALL(uring_setup, 3),
+    SYSCALL(uring_enter, 1),
+    SYSCALL(trace_task, 2),
+    SYSCALL(trace_read, 1),
+    SYSCALL(dump_syscalls, 0),
+    SYSCALL(readv, 4),
+    SYSCALL(writev, 4),
+    SYSCALL(monitor_writev, 2),
 };
-u32int num_syscalls = 1;
+#define NR_SYSCALLS     (sizeof(syscalls) / sizeof(syscalls[0]))
+const u32int num_syscalls = NR_SYSCALLS;
+
+/* Counters of one system call on one processor. Only that processor
+ * writes them. */
+typedef struct {
+    u32int count;
+    u64int cycles;
+} syscall_stat_t;
+
+static syscall_stat_t syscall_stats[MAX_CPUS][NR_SYSCALLS];
+
+/* Ring of trace records. When it is full new records are dropped. */
+static syscall_trace_t trace_ring[SYSCALL_TRACE_RECORDS];
+static u32int trace_head, trace_tail, trace_lost;
+static spinlock_t trace_lock = SPINLOCK_INIT("syscall trace");
 
 void initialise_syscalls(void)
 {
     /* Register our syscall handler. */
     register_interrupt_handler(0x80, &syscall_handler);
+
+    /* int 0x80 stays for processors without sysenter. */
+    if (sysenter_present())
+        syscall_entry = &syscall_sysenter;
+}
+
+u32int measure_null_syscall(void *entry)
+{
+    const u32int rounds = 1000;
+    u32int i;
+    int ret;
+
+    /* getpid does next to nothing. Warm up the caches and the branch
+     * predictors first. */
+    for (i = 0; i < 16; ++i)
+        asm volatile ("call *%1" : "=a" (ret) : "r" (entry), "0" (5)
+                      : "memory");
+
+    u64int start = rdtsc();
+    for (i = 0; i < rounds; ++i)
+        asm volatile ("call *%1" : "=a" (ret) : "r" (entry), "0" (5)
+                      : "memory");
+    return (u32int) div_u64_u32(rdtsc() - start, rounds, 0);
+}
+
+/*
+ * Print the result of one benchmark through the monitor_write system call.
+ * User mode can only write to its stack, so the line is built there.
+ */
+static void bench_report(const char *what, u32int cycles)
+{
+    char line[80], digits[11], number[11];
+    u32int n = 0, i = 0;
+    do {
+        digits[n++] = '0' + cycles % 10;
+        cycles /= 10;
+    } while (cycles);
+    while (n)
+        number[i++] = digits[--n];
+    number[i] = 0;
+
+    strcpy(line, "Null syscall through ");
+    strcat(line, what);
+    strcat(line, " takes ");
+    strcat(line, number);
+    strcat(line, " cycles\n");
+    syscall_monitor_write(line);
+}
+
+void bench_syscalls(void)
+{
+    bench_report("int 0x80", measure_null_syscall(&syscall_int80));
+    if (sysenter_present())
+        bench_report("sysenter", measure_null_syscall(&syscall_sysenter));
 }
 
 void syscall_handler(registers_t *regs)
 {
-    /* First check if the requested syscall number is valid.
-     * The syscall number is found in EAX. */
-    if (regs->eax >= num_syscalls)
-        PANIC("Bad syscall");   /* This should rather be simple return. */
+    /* The syscall number is found in EAX. */
+    if (regs->eax >= num_syscalls) {
+        regs->eax = -ENOSYS;
+        return;
+    }
 
-    /* Get the required syscall location. */
-    void *location = syscalls[regs->eax];
+    task_t *task = get_current_task();
+    if (task)
+        task->usage.syscalls++;
 
-    /* We don't know how many parameters the function wants, so we just push
-     * them all onto the stack in the correct order. The function will use
-     * all the parameters it wants and we can pop them all back afterwards. */
-    int ret;
-    asm volatile (
-            "push %1;"
-            "push %2;"
-            "push %3;"
-            "push %4;"
-            "push %5;"
-            "call *%6;"
-            "pop %%ebx;"
-            "pop %%ebx;"
-            "pop %%ebx;"
-            "pop %%ebx;"
-            "pop %%ebx;"
-            : "=a" (ret)
-            : "r" (regs->edi), "r" (regs->esi), "r" (regs->edx),
-              "r" (regs->ecx), "r" (regs->ebx), "r" (location)
-            );
-    regs->eax = ret;
+    u32int nr = regs->eax;
+    u64int start = ktime_cycles();
+    regs->eax = syscalls[nr].handler(regs);
+    u64int cycles = ktime_cycles() - start;
+
+    /* The handler may have slept and moved to another processor. Only
+     * the executing processor writes its statistics, so keep it from
+     * changing while they are updated. */
+    u32int flags = irq_save();
+    syscall_stat_t *stat = &syscall_stats[cpu_index()][nr];
+    stat->count++;
+    stat->cycles += cycles;
+    irq_restore(flags);
+
+    if (task && task->trace)
+        trace_record(task, nr, regs, cycles);
+}
+
+/*
+ * Append a record to the trace.
+ */
+static void trace_record(task_t *task, u32int nr, registers_t *regs,
+                         u64int cycles)
+{
+    u32int flags = spin_lock_irqsave(&trace_lock);
+    if (trace_tail - trace_head == SYSCALL_TRACE_RECORDS) {
+        trace_lost++;
+    } else {
+        syscall_trace_t *rec = &trace_ring[trace_tail++ % SYSCALL_TRACE_RECORDS];
+        rec->pid = task->id;
+        rec->nr = nr;
+        rec->args[0] = regs->ebx;
+        rec->args[1] = regs->ecx;
+        rec->args[2] = regs->edx;
+        rec->args[3] = regs->esi;
+        rec->args[4] = regs->edi;
+        rec->ret = regs->eax;
+        rec->ns = (u32int) cycles_to_ns(cycles);
+    }
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+int trace_read(syscall_trace_t *rec)
+{
+    int found = 0;
+    u32int flags = spin_lock_irqsave(&trace_lock);
+    if (trace_head != trace_tail) {
+        *rec = trace_ring[trace_head++ % SYSCALL_TRACE_RECORDS];
+        found = 1;
+    }
+    spin_unlock_irqrestore(&trace_lock, flags);
+    return found;
+}
+
+/*
+ * Write a record to the serial port, one line per call:
+ * pid name(args) = ret ns
+ */
+static void trace_write(syscall_trace_t *rec)
+{
+    u32int i;
+    serial_write_hex(rec->pid);
+    serial_put(' ');
+    serial_write(syscalls[rec->nr].name);
+    serial_put('(');
+    for (i = 0; i < syscalls[rec->nr].nargs; ++i) {
+        if (i)
+            serial_write(", ");
+        serial_write_hex(rec->args[i]);
+    }
+    serial_write(") = ");
+    serial_write_hex(rec->ret);
+    serial_put(' ');
+    serial_write_hex(rec->ns);
+    serial_put('\n');
+}
+
+int dump_syscalls(void)
+{
+    u32int nr, cpu;
+
+    monitor_write("    calls  avg cyc syscall\n");
+    for (nr = 0; nr < NR_SYSCALLS; ++nr) {
+        u32int count = 0;
+        u64int cycles = 0;
+        for (cpu = 0; cpu < MAX_CPUS; ++cpu) {
+            count += syscall_stats[cpu][nr].count;
+            cycles += syscall_stats[cpu][nr].cycles;
+        }
+        if (!count)
+            continue;
+        monitor_print("%9u %8u %s\n", count,
+                (u32int) div_u64_u32(cycles, count, 0), syscalls[nr].name);
+    }
+
+    syscall_trace_t rec;
+    while (trace_read(&rec))
+        trace_write(&rec);
+    if (trace_lost) {
+        monitor_print("syscall trace: %u records lost\n", trace_lost);
+        trace_lost = 0;
+    }
+    return 0;
 }
 
 DEFN_SYSCALL1(monitor_write, 0, const char *)
+DEFN_SYSCALL2(getrusage, 1, int, rusage_t *)
+DEFN_SYSCALL1(gettime, 2, u64int *)
+DEFN_SYSCALL1(profile, 3, u32int)
+DEFN_SYSCALL0(dump_interrupts, 4)
+DEFN_SYSCALL0(getpid, 5)
+DEFN_SYSCALL3(uring_setup, 6, u32int, u32int, uring_shared_t **)
+DEFN_SYSCALL1(uring_enter, 7, u32int)
+DEFN_SYSCALL2(trace_task, 8, int, u32int)
+DEFN_SYSCALL1(trace_read, 9, syscall_trace_t *)
+DEFN_SYSCALL0(dump_syscalls, 10)
+DEFN_SYSCALL4(readv, 11, const char *, u32int, const iovec_t *, u32int)
+DEFN_SYSCALL4(writev, 12, const char *, u32int, const iovec_t *, u32int)
+DEFN_SYSCALL2(monitor_writev, 13, const iovec_t *, u32int)
@@ -11,12 +11,87 @@
 #define SYSCALL_H
 
 #include "common.h"
+#include "fs.h"
+#include "isr.h"
+#include "task.h"
+#include "uring.h"
+
+/** Entry of the system call table. */
+typedef struct {
+    /** Takes the arguments out of the saved registers and makes the call,
+     * returns the result or a negated error number. */
+    int (*handler)(registers_t *regs);
+    /** Number of arguments taken. */
+    u32int nargs;
+    /** Name of the call. */
+    const char *name;
+} syscall_t;
+
+/** Number of entries in the system call table. */
+extern const u32int num_syscalls;
+
+/** Number of records kept by the system call trace. */
+#define SYSCALL_TRACE_RECORDS   256
+
+/** Record of one traced system call. */
+typedef struct {
+    /** Process ID of the caller. */
+    u32int pid;
+    /** Number of the call. */
+    u32int nr;
+    /** Arguments, as passed in the registers. */
+    u32int args[5];
+    /** Returned value. */
+    s32int ret;
+    /** Time the call took in nanoseconds. */
+    u32int ns;
+} syscall_trace_t;
+
+/**
+ * Take the oldest record out of the system call trace. Tasks are traced
+ * once trace_task() was called for them.
+ *
+ * @param[out] rec  where to store the record
+ * @return 1 if a record was stored, 0 if the trace is empty
+ */
+int trace_read(syscall_trace_t *rec);
+
+/**
+ * Print the number of calls and the cycles spent in each system call to
+ * the monitor, and write the records left in the trace to the serial port.
+ *
+ * @return zero
+ */
+int dump_syscalls(void);
 
 /**
  * Enable syscall dispatch system.
  */
 void initialise_syscalls(void);
 
+/**
+ * User side entry of system calls: int 0x80, or sysenter when the processor
+ * has it. Called with the number in eax and the arguments in ebx, ecx, edx,
+ * esi and edi, returns the result in eax and preserves all other registers.
+ */
+extern void *syscall_entry;
+
+/**
+ * Measure the round trip of a system call which does nothing. Must be
+ * called from user mode, sysexit always returns to ring 3.
+ *
+ * @param entry either syscall_int80 or syscall_sysenter
+ * @return average number of TSC cycles taken by one call
+ */
+u32int measure_null_syscall(void *entry);
+
+/**
+ * Print the cost of a null system call through int 0x80 and, if the
+ * processor has it, sysenter. Must be called from user mode, after
+ * initialise_syscalls().
+ */
+void bench_syscalls(void);
+
 #define DECL_SYSCALL0(fn)                int syscall_##fn(void)
 #define DECL_SYSCALL1(fn,p1)             int syscall_##fn(p1)
 #define DECL_SYSCALL2(fn,p1,p2)          int syscall_##fn(p1,p2)
@@ -28,7 +103,8 @@ void initialise_syscalls(void);
     int syscall_##fn(void) \
     { \
         int a; \
-        asm volatile ("int $0x80" : "=a" (a) : "0" (num)); \
+        asm volatile ("call *syscall_entry" : "=a" (a) : "0" (num) \
+                : "memory"); \
         return a; \
     }
 
@@ -36,7 +112,8 @@ void initialise_syscalls(void);
     int syscall_##fn(P1 p1) \
     { \
         int a; \
-        asm volatile ("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1)); \
+        asm volatile ("call *syscall_entry" : "=a" (a) \
+                : "0" (num), "b" ((int)p1) : "memory"); \
         return a; \
     }
 
@@ -44,8 +121,8 @@ void initialise_syscalls(void);
     int syscall_##fn(P1 p1,P2 p2) \
     { \
         int a; \
-        asm volatile ("int $0x80" : "=a" (a) \
-                : "0" (num), "b" ((int)p1), "c" ((int)p2)); \
+        asm volatile ("call *syscall_entry" : "=a" (a) \
+                : "0" (num), "b" ((int)p1), "c" ((int)p2) : "memory"); \
         return a; \
     }
 
@@ -53,8 +130,9 @@ void initialise_syscalls(void);
     int syscall_##fn(P1 p1,P2 p2,P3 p3) \
     { \
         int a; \
-        asm volatile ("int $0x80" : "=a" (a) \
-                : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3)); \
+        asm volatile ("call *syscall_entry" : "=a" (a) \
+                : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3) \
+                : "memory"); \
         return a; \
     }
 
@@ -62,9 +140,9 @@ void initialise_syscalls(void);
     int syscall_##fn(P1 p1,P2 p2,P3 p3,P4 p4) \
     { \
         int a; \
-        asm volatile ("int $0x80" : "=a" (a) \
+        asm volatile ("call *syscall_entry" : "=a" (a) \
                 : "0" (num), "b" ((int)p1), "c" ((int)p2), \
-                  "d" ((int)p3), "S" ((int)p4)); \
+                  "d" ((int)p3), "S" ((int)p4) : "memory"); \
         return a; \
     }
 
@@ -72,12 +150,25 @@ void initialise_syscalls(void);
     int syscall_##fn(P1 p1,P2 p2,P3 p3,P4 p4,P5 p5) \
     { \
         int a; \
-        asm volatile ("int $0x80" : "=a" (a) \
+        asm volatile ("call *syscall_entry" : "=a" (a) \
                 : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), \
-                "S" ((int)p4), "D" ((int)p5)); \
+                "S" ((int)p4), "D" ((int)p5) : "memory"); \
         return a; \
     }
 
 DECL_SYSCALL1(monitor_write, const char *);
+DECL_SYSCALL2(getrusage, int, rusage_t *);
+DECL_SYSCALL1(gettime, u64int *);
+DECL_SYSCALL1(profile, u32int);
+DECL_SYSCALL0(dump_interrupts);
+DECL_SYSCALL0(getpid);
+DECL_SYSCALL3(uring_setup, u32int, u32int, uring_shared_t **);
+DECL_SYSCALL1(uring_enter, u32int);
+DECL_SYSCALL2(trace_task, int, u32int);
+DECL_SYSCALL1(trace_read, syscall_trace_t *);
+DECL_SYSCALL0(dump_syscalls);
+DECL_SYSCALL4(readv, const char *, u32int, const iovec_t *, u32int);
+DECL_SYSCALL4(writev, const char *, u32int, const iovec_t *, u32int);
+DECL_SYSCALL2(monitor_writev, const iovec_t *, u32int);
 
 #endif /* end of include guard: SYSCALL_H */
@@ -3,60 +3,145 @@
  * Written for JamesM's kernel development tutorial.
  */
 
+#include <errno.h>
 #include <string.h>
 
 #include "descriptor-tables.h"
 #include "kheap.h"
+#include "monitor.h"
+#include "smp.h"
 #include "task.h"
+#include "timer.h"
+#include "timer-wheel.h"
+#include "vdso.h"
 
-/* The currently running task. */
-volatile task_t *current_task = 0;
-
-/* The start of the task linked list. */
-volatile task_t *ready_queue;
+/* The currently running task. Each processor has its own. */
+#define current_task (this_cpu()->current)
 
 /* Defined in kmain.c */
 extern u32int initial_esp;
 /* Defined in paging.c */
 extern page_directory_t *kernel_directory;
-extern page_directory_t *current_directory;
-/* Defined in ??? */
+/* Defined in process.s */
 extern u32int read_eip(void);
 
 /* The next available process ID. */
 u32int next_pid = 1;
+/* Protects next_pid. */
+static spinlock_t pid_lock = SPINLOCK_INIT("pid");
 
-void initialise_tasking(void)
+/* All tasks except the idle tasks, whether they are ready, sleeping or
+ * blocked, linked through next_all. */
+static task_t *all_tasks = 0;
+/* Protects all_tasks. */
+static spinlock_t all_tasks_lock = SPINLOCK_INIT("tasks");
+
+static int alloc_pid(void)
 {
-    /* Disable interrupts. */
-    asm volatile ("cli");
+    spin_lock(&pid_lock);
+    int pid = next_pid++;
+    spin_unlock(&pid_lock);
+    return pid;
+}
 
-    /* Relocate the stack so we know where it is. */
-    move_stack((void *) 0xE0000000, 0x2000);
+static void add_task(task_t *task)
+{
+    u32int flags = spin_lock_irqsave(&all_tasks_lock);
+    task->next_all = all_tasks;
+    all_tasks = task;
+    spin_unlock_irqrestore(&all_tasks_lock, flags);
+}
 
-    /* Initialise the first task (kernel task). */
-    current_task = ready_queue = kmalloc(sizeof(task_t));
-    current_task->id = next_pid++;
-    current_task->esp = current_task->ebp = 0;
-    current_task->eip = 0;
-    current_task->page_directory = current_directory;
-    current_task->next = 0;
-    current_task->kernel_stack = (u32int) kmalloc_a(KERNEL_STACK_SIZE);
+static void remove_task(task_t *task)
+{
+    u32int flags = spin_lock_irqsave(&all_tasks_lock);
+    task_t **p = &all_tasks;
+    while (*p != task)
+        p = &(*p)->next_all;
+    *p = task->next_all;
+    spin_unlock_irqrestore(&all_tasks_lock, flags);
+}
 
-    /* Re-enable interrupts. */
-    asm volatile ("sti");
+/*
+ * Append a task to the ready queue of a processor. The queue must be
+ * locked.
+ */
+static void enqueue_task(cpu_t *cpu, task_t *task)
+{
+    task->next = 0;
+    task->cpu = cpu->index;
+    if (!cpu->ready_queue) {
+        cpu->ready_queue = task;
+    } else {
+        task_t *tmp_task = cpu->ready_queue;
+        while (tmp_task->next)
+            tmp_task = tmp_task->next;
+        tmp_task->next = task;
+    }
+    cpu->nr_tasks++;
 }
 
-void switch_task(void)
+/*
+ * Remove a task from the ready queue of a processor. The queue must be
+ * locked.
+ */
+static void dequeue_task(cpu_t *cpu, task_t *task)
 {
-    /* If we haven't initialised tasking yet, just return. */
-    if (!current_task)
-        return;
+    if (cpu->ready_queue == task) {
+        cpu->ready_queue = task->next;
+    } else {
+        task_t *tmp_task = cpu->ready_queue;
+        while (tmp_task->next != task)
+            tmp_task = tmp_task->next;
+        tmp_task->next = task->next;
+    }
+    task->next = 0;
+    cpu->nr_tasks--;
+}
 
-    /* This fixes the triple fault that happens in Qemu and page fault in
-     * Bochs. I have no idea why it works, though. */
-    asm volatile ("nop");
+/*
+ * Take a task from the processor with the longest ready queue and move it
+ * to the queue of given processor, whose queue must be locked. The victim
+ * is only try-locked, so two processors stealing from each other can not
+ * deadlock.
+ */
+static task_t *steal_task(cpu_t *cpu)
+{
+    cpu_t *victim = 0;
+    u32int i;
+    for (i = 0; i < MAX_CPUS; ++i) {
+        cpu_t *other = &cpus[i];
+        if (other == cpu || !other->online || !other->nr_tasks)
+            continue;
+        if (!victim || other->nr_tasks > victim->nr_tasks)
+            victim = other;
+    }
+    if (!victim || !spin_trylock(&victim->lock))
+        return 0;
 
+    /* Any task except the one running there can be taken. Tasks that were
+     * switched out are completely saved, because the queue lock is held
+     * until the switch is done. */
+    task_t *task = victim->ready_queue;
+    while (task && task == victim->current)
+        task = task->next;
+    if (task)
+        dequeue_task(victim, task);
+    spin_unlock(&victim->lock);
+
+    if (task)
+        enqueue_task(cpu, task);
+    return task;
+}
+
+/*
+ * Save state of the current task and switch to the next one. Must be called
+ * with interrupts disabled and the ready queue of the processor locked; the
+ * lock is released once we are no longer running on the old stack.
+ * `voluntary` tells whether the task gives up the processor itself.
+ */
+static void schedule(cpu_t *cpu, int voluntary)
+{
     u32int esp, ebp, eip;
     asm volatile ("mov %%esp, %0" : "=r" (esp));
     asm volatile ("mov %%ebp, %0" : "=r" (ebp));
@@ -78,31 +163,53 @@ void switch_task(void)
         return;
 
     /* No, we did not. Let's save some register values and switch. */
-    current_task->eip = eip;
-    current_task->esp = esp;
-    current_task->ebp = ebp;
+    task_t *prev = cpu->current;
+    prev->eip = eip;
+    prev->esp = esp;
+    prev->ebp = ebp;
+
+    /* Get the next task to run. If we fell of the end of the list (or the
+     * current task is not in the list), start again at the beginning. */
+    task_t *next = prev->next;
+    if (!next)
+        next = cpu->ready_queue;
+    /* If we have nothing to do, help someone else. */
+    if (!next)
+        next = steal_task(cpu);
+    if (!next)
+        next = cpu->idle_task;
+
+    if (next == prev) {
+        spin_unlock(&cpu->lock);
+        return;
+    }
 
-    /* Get the next task to run. */
-    current_task = current_task->next;
-    /* If we fell of the end of the list, start again at the beginning. */
-    if (!current_task)
-        current_task = ready_queue;
+    if (voluntary)
+        prev->usage.nvcsw++;
+    else
+        prev->usage.nivcsw++;
 
-    eip = current_task->eip;
-    esp = current_task->esp;
-    ebp = current_task->ebp;
+    cpu->current = next;
+    vdso_set_pid(cpu->index, next->id);
+    eip = next->eip;
+    esp = next->esp;
+    ebp = next->ebp;
 
     /* Make sure the memory manager knows we've changed page directory. */
-    current_directory = current_task->page_directory;
+    cpu->directory = next->page_directory;
 
     /* Change our kernel stack over. */
-    set_kernel_stack(current_task->kernel_stack + KERNEL_STACK_SIZE);
+    set_kernel_stack(next->kernel_stack + KERNEL_STACK_SIZE);
+
+    /* The lock is released by the code below, account it now. */
+    spin_release_stats(&cpu->lock);
 
     /* Here we:
      * 1) stop interrupts so we don't get interrupted,
-     * 2) temporarily put the new EIP location in ECX,
-     * 3) load the stack and base pointers from the new task,
-     * 4) change page directory to the physical address of the new directory
+     * 2) load the stack and base pointers from the new task (the new EIP
+     *    location is already in ECX),
+     * 3) change page directory to the physical address of the new directory
+     * 4) release the ready queue lock, we are off the old stack now,
      * 5) put a dummy value in the EAX so that above we can recognise that
      *    we've just switched tasks,
      * 6) restart interrupts. The STI instruction has a delay - it doesn't
@@ -110,14 +217,330 @@ void switch_task(void)
      * 7) Jump to the location in ECX (we put the new EIP there). */
     asm volatile(
             "cli;"
-            "mov %0, %%ecx;"
             "mov %1, %%esp;"
             "mov %2, %%ebp;"
             "mov %3, %%cr3;"
+            "movl $0, (%%eax);"
             "mov $0x12345, %%eax;"
             "sti;"
             "jmp *%%ecx"
-            : : "r"(eip), "r"(esp), "r"(ebp), "r"(current_directory->physicalAddr));
+            : : "c"(eip), "r"(esp), "r"(ebp),
+                "r"(next->page_directory->physicalAddr),
+                "a"(&cpu->lock.locked));
+}
+
+/*
+ * Allocate a task that will start by calling fn(arg) on its own kernel
+ * stack. The task is not queued and has no ID yet.
+ */
+static task_t *new_kernel_task(kthread_fn_t fn, void *arg);
+static void reap_dead_tasks(cpu_t *cpu);
+
+void cpu_idle(void)
+{
+    for (;;) {
+        /* Threads that exited here are switched out completely once we
+         * run. */
+        u32int flags = irq_save();
+        reap_dead_tasks(this_cpu());
+        irq_restore(flags);
+        asm volatile ("sti; hlt");
+    }
+}
+
+/*
+ * Body of the idle task of the boot processor.
+ */
+static void idle_loop(void *arg)
+{
+    cpu_idle();
+}
+
+void initialise_tasking(void)
+{
+    /* Disable interrupts. */
+    u32int flags = irq_save();
+
+    /* Relocate the stack so we know where it is. */
+    move_stack((void *) BOOT_STACK_TOP, BOOT_STACK_SIZE);
+
+    cpu_t *cpu = this_cpu();
+
+    /* Initialise the first task (kernel task). */
+    task_t *task = kmalloc(sizeof(task_t));
+    task->id = alloc_pid();
+    task->esp = task->ebp = 0;
+    task->eip = 0;
+    task->page_directory = current_directory;
+    task->next = 0;
+    task->next_dead = 0;
+    task->next_all = 0;
+    task->kernel_stack = kstack_alloc();
+    memset(&task->usage, 0, sizeof(rusage_t));
+    task->uring = 0;
+    task->trace = 0;
+
+    cpu->idle_task = new_kernel_task(&idle_loop, 0);
+    cpu->idle_task->id = 0;
+
+    add_task(task);
+    spin_lock(&cpu->lock);
+    enqueue_task(cpu, task);
+    cpu->current = task;
+    vdso_set_pid(cpu->index, task->id);
+    cpu->last_tick = tick;
+    spin_unlock(&cpu->lock);
+
+    /* Restore interrupts. */
+    irq_restore(flags);
+}
+
+void initialise_tasking_ap(u32int stack)
+{
+    cpu_t *cpu = this_cpu();
+
+    /* The code that is running now becomes the idle task. Its registers
+     * are saved by the first switch away from it. */
+    task_t *idle = kmalloc(sizeof(task_t));
+    idle->id = 0;
+    idle->esp = idle->ebp = 0;
+    idle->eip = 0;
+    idle->page_directory = current_directory;
+    idle->next = 0;
+    idle->next_dead = 0;
+    idle->next_all = 0;
+    idle->kernel_stack = stack;
+    memset(&idle->usage, 0, sizeof(rusage_t));
+    idle->uring = 0;
+    idle->trace = 0;
+
+    cpu->idle_task = cpu->current = idle;
+    cpu->last_tick = tick;
+}
+
+void switch_task(void)
+{
+    cpu_t *cpu = this_cpu();
+
+    /* If we haven't initialised tasking yet, just return. */
+    if (!cpu->current)
+        return;
+
+    /* This fixes the triple fault that happens in Qemu and page fault in
+     * Bochs. I have no idea why it works, though. */
+    asm volatile ("nop");
+
+    spin_lock(&cpu->lock);
+    schedule(cpu, 0);
+}
+
+void yield(void)
+{
+    cpu_t *cpu = this_cpu();
+    if (!cpu->current)
+        return;
+
+    u32int flags = spin_lock_irqsave(&cpu->lock);
+    schedule(cpu, 1);
+    irq_restore(flags);
+}
+
+/*
+ * Timer callback putting a sleeping task back on the ready queue of its
+ * processor. Its lock is held until the task is switched out completely,
+ * so a task is never woken up while it is still going to sleep.
+ */
+static void wake_task(void *arg)
+{
+    task_t *task = arg;
+    cpu_t *cpu = &cpus[task->cpu];
+    u32int flags = spin_lock_irqsave(&cpu->lock);
+    enqueue_task(cpu, task);
+    spin_unlock_irqrestore(&cpu->lock, flags);
+    timer_kick(cpu);
+}
+
+void wake_up(task_t *task)
+{
+    wake_task(task);
+}
+
+void block_task(spinlock_t *lock)
+{
+    cpu_t *cpu = this_cpu();
+    spin_lock(&cpu->lock);
+    dequeue_task(cpu, cpu->current);
+    spin_unlock(lock);
+    schedule(cpu, 1);
+}
+
+void sleep(u32int ms)
+{
+    u32int expires = timer_ticks() + msecs_to_ticks(ms);
+    cpu_t *cpu = this_cpu();
+    task_t *task = cpu->current;
+
+    /* The idle task can not leave the processor, wait in place. There may
+     * be no interrupt to wake us from hlt in tickless mode. */
+    if (!task || task == cpu->idle_task) {
+        while (!time_after_eq(timer_ticks(), expires))
+            asm volatile ("pause");
+        return;
+    }
+
+    /* The timer lives on our stack, which stays in place until we are
+     * woken up. */
+    ktimer_t timer;
+    init_ktimer(&timer, &wake_task, task);
+    timer.expires = expires;
+
+    u32int flags = spin_lock_irqsave(&cpu->lock);
+    dequeue_task(cpu, task);
+    add_timer(&timer);
+    schedule(cpu, 1);
+    irq_restore(flags);
+}
+
+void account_tick(registers_t *regs)
+{
+    /* In tickless mode, several ticks may have passed since the last
+     * interrupt. They are all charged to the interrupted task. */
+    cpu_t *cpu = this_cpu();
+    u32int ticks = tick - cpu->last_tick;
+    cpu->last_tick = tick;
+
+    task_t *task = cpu->current;
+    if (!task)
+        return;
+    if ((regs->cs & 0x3) == 0x3)
+        task->usage.utime += ticks;
+    else
+        task->usage.stime += ticks;
+}
+
+task_t *get_current_task(void)
+{
+    return current_task;
+}
+
+/*
+ * Find a task by process ID. all_tasks_lock must be held.
+ */
+static task_t *find_task(int pid)
+{
+    task_t *task;
+    for (task = all_tasks; task; task = task->next_all) {
+        if (task->id == pid)
+            return task;
+    }
+    return 0;
+}
+
+int trace_task(int pid, u32int on)
+{
+    task_t *self = current_task;
+    if (!self)
+        return -ESRCH;
+    if (!pid)
+        pid = self->id;
+
+    u32int flags = spin_lock_irqsave(&all_tasks_lock);
+    task_t *task = find_task(pid);
+    if (task)
+        task->trace = on;
+    spin_unlock_irqrestore(&all_tasks_lock, flags);
+    return task ? 0 : -ESRCH;
+}
+
+/*
+ * Sample the size of the private part of the address space of a task.
+ */
+static void update_maxrss(task_t *task)
+{
+    u32int rss = count_private_pages(task->page_directory);
+    if (rss > task->usage.maxrss)
+        task->usage.maxrss = rss;
+}
+
+/*
+ * Copy the resource usage of a task, after sampling its address space.
+ * The page directory is walked without any lock held, which is safe as
+ * page directories are never freed. Returns -ESRCH if there is no such
+ * task.
+ */
+static int task_usage(int pid, rusage_t *usage, u32int *cpu)
+{
+    u32int flags = spin_lock_irqsave(&all_tasks_lock);
+    task_t *task = find_task(pid);
+    page_directory_t *dir = task ? task->page_directory : 0;
+    spin_unlock_irqrestore(&all_tasks_lock, flags);
+    if (!task)
+        return -ESRCH;
+
+    u32int rss = count_private_pages(dir);
+
+    /* The task may have exited meanwhile. */
+    flags = spin_lock_irqsave(&all_tasks_lock);
+    task = find_task(pid);
+    if (task) {
+        if (rss > task->usage.maxrss)
+            task->usage.maxrss = rss;
+        *usage = task->usage;
+        *cpu = task->cpu;
+    }
+    spin_unlock_irqrestore(&all_tasks_lock, flags);
+    return task ? 0 : -ESRCH;
+}
+
+int getrusage(int pid, rusage_t *usage)
+{
+    task_t *self = current_task;
+    if (!self)
+        return -ESRCH;
+    if (!pid)
+        pid = self->id;
+
+    rusage_t tmp;
+    u32int cpu;
+    int ret = task_usage(pid, &tmp, &cpu);
+    if (ret)
+        return ret;
+    memcpy(usage, &tmp, sizeof(rusage_t));
+    return 0;
+}
+
+/*
+ * Print one line of dump_tasks().
+ */
+static void dump_task(int pid, u32int cpu, rusage_t *usage)
+{
+    monitor_print("%5u %3u %6u %6u %6u %6u %6u %8u %6u\n",
+            pid, cpu, usage->utime, usage->stime,
+            usage->nvcsw, usage->nivcsw, usage->page_faults,
+            usage->syscalls, usage->maxrss);
+}
+
+void dump_tasks(void)
+{
+    monitor_write("  pid cpu   user    sys   vcsw  ivcsw faults syscalls maxrss\n");
+    u32int i, cpu;
+    rusage_t usage;
+
+    /* Idle tasks never exit and are not in all_tasks. */
+    for (i = 0; i < MAX_CPUS; ++i) {
+        task_t *idle = cpus[i].idle_task;
+        if (!cpus[i].online || !idle)
+            continue;
+        update_maxrss(idle);
+        usage = idle->usage;
+        dump_task(0, i, &usage);
+    }
+
+    int pid;
+    for (pid = 1; pid < (int) next_pid; ++pid) {
+        if (!task_usage(pid, &usage, &cpu))
+            dump_task(pid, cpu, &usage);
+    }
 }
 
 int fork(void)
@@ -127,31 +550,29 @@ int fork(void)
         PANIC("Call to initialise_tasking is required to enable forking!");
 
     /* We are modifying kernel structures, and so cannot be interrupted. */
-    asm volatile ("cli");
+    u32int flags = irq_save();
 
     /* Take a pointer to this process' task struct for later reference. */
-    task_t *parent_task = (task_t*) current_task;
+    task_t *parent_task = current_task;
 
     /* Clone the address space. */
     page_directory_t *dir = clone_directory(current_directory);
 
     /* Create a new process. */
     task_t *new_task = kmalloc(sizeof(task_t));
-    new_task->id = next_pid++;
+    new_task->id = alloc_pid();
     new_task->esp = new_task->ebp = 0;
     new_task->eip = 0;
     new_task->page_directory = dir;
-    /* TODO: why current_task? */
-    current_task->kernel_stack = (u32int) kmalloc_a(KERNEL_STACK_SIZE);
+    new_task->kernel_stack = kstack_alloc();
     new_task->next = 0;
-
-    /* Add it to the end of the ready queue. */
-    /* First find the end. */
-    task_t *tmp_task = (task_t *) ready_queue;
-    while (tmp_task->next)
-        tmp_task = tmp_task->next;
-    /* And extend it ... */
-    tmp_task->next = new_task;
+    new_task->next_dead = 0;
+    new_task->next_all = 0;
+    memset(&new_task->usage, 0, sizeof(rusage_t));
+    new_task->uring = 0;
+    new_task->trace = 0;
+    new_task->usage.maxrss = count_private_pages(dir);
+    update_maxrss(parent_task);
 
     /* This will be the entry point for the new process. */
     u32int eip = read_eip();
@@ -165,8 +586,18 @@ int fork(void)
         new_task->esp = esp;
         new_task->ebp = ebp;
         new_task->eip = eip;
-        /* All finished: reenable interrupts. */
-        asm volatile ("sti");
+
+        /* Only now the child is complete, so add it to the end of our ready
+         * queue. Another processor may steal it right away. */
+        add_task(new_task);
+        cpu_t *cpu = this_cpu();
+        spin_lock(&cpu->lock);
+        enqueue_task(cpu, new_task);
+        spin_unlock(&cpu->lock);
+        timer_kick(cpu);
+
+        /* All finished: restore interrupts. */
+        irq_restore(flags);
         return new_task->id;
     } else {
         /* We are the child, by convention return 0. */
@@ -174,6 +605,100 @@ int fork(void)
     }
 }
 
+/*
+ * First code executed by a new kernel thread. switch_task() jumps here with
+ * the stack prepared by new_kernel_task(), so the arguments are found where
+ * a normal call would have put them.
+ */
+static void kthread_start(kthread_fn_t fn, void *arg)
+{
+    fn(arg);
+    kthread_exit();
+}
+
+/*
+ * Release memory of kernel threads that exited on this processor. Must be
+ * called with interrupts disabled.
+ */
+static void reap_dead_tasks(cpu_t *cpu)
+{
+    while (cpu->dead_tasks) {
+        task_t *task = cpu->dead_tasks;
+        cpu->dead_tasks = task->next_dead;
+        remove_task(task);
+        kstack_free(task->kernel_stack);
+        kfree(task);
+    }
+}
+
+static task_t *new_kernel_task(kthread_fn_t fn, void *arg)
+{
+    task_t *new_task = kmalloc(sizeof(task_t));
+    new_task->page_directory = current_directory;
+    new_task->kernel_stack = kstack_alloc();
+    new_task->next = 0;
+    new_task->next_dead = 0;
+    new_task->next_all = 0;
+    memset(&new_task->usage, 0, sizeof(rusage_t));
+    new_task->uring = 0;
+    new_task->trace = 0;
+
+    /* Build a frame as if kthread_start(fn, arg) had been called: the two
+     * arguments and a dummy return address. */
+    u32int *stack = (u32int *) (new_task->kernel_stack + KERNEL_STACK_SIZE);
+    *--stack = (u32int) arg;
+    *--stack = (u32int) fn;
+    *--stack = 0;
+    new_task->esp = (u32int) stack;
+    new_task->ebp = 0;
+    new_task->eip = (u32int) &kthread_start;
+    return new_task;
+}
+
+task_t *kthread_create(kthread_fn_t fn, void *arg)
+{
+    if (!current_task)
+        PANIC("Call to initialise_tasking is required to create threads!");
+
+    u32int flags = irq_save();
+
+    cpu_t *cpu = this_cpu();
+    reap_dead_tasks(cpu);
+
+    task_t *new_task = new_kernel_task(fn, arg);
+    new_task->id = alloc_pid();
+    add_task(new_task);
+
+    spin_lock(&cpu->lock);
+    enqueue_task(cpu, new_task);
+    spin_unlock(&cpu->lock);
+    timer_kick(cpu);
+
+    irq_restore(flags);
+    return new_task;
+}
+
+void kthread_exit(void)
+{
+    /* We never return, so the flags need not be kept. */
+    irq_save();
+
+    cpu_t *cpu = this_cpu();
+    task_t *task = cpu->current;
+
+    /* Leave the ready queue. With no next task, schedule() starts again
+     * at the beginning of the queue. */
+    spin_lock(&cpu->lock);
+    dequeue_task(cpu, task);
+
+    /* We are still running on the stack, so it can only be freed later. */
+    task->next_dead = cpu->dead_tasks;
+    cpu->dead_tasks = task;
+
+    schedule(cpu, 1);
+    PANIC("Exited kernel thread was rescheduled!");
+}
+
 void move_stack(void *new_stack_start, u32int size)
 {
     u32int i;
@@ -250,11 +775,13 @@ void switch_to_user_mode(void)
             "pushl $0x23;"      /* Push stack segment selector. */
             "pushl %eax;"       /* Push the stack pointer value we want it
                                    to have after iret. */
-            "pushf;"            /* Push current value of EFLAGS. */
+            "pushf;"            /* Push current value of EFLAGS, */
+            "pop %eax;"         /* with interrupts enabled once in user */
+            "or $0x200, %eax;"  /* mode. */
+            "push %eax;"
             "pushl $0x1B;"      /* Push the code segment selector. */
             "push $1f;"         /* Push location of the 1: label. */
             "iret;"             /* After this we should be in user-mode. */
             "1:\n"
             );
-    /* TODO: are interrupts enabled again? */
 }
@@ -9,10 +9,34 @@
 #ifndef TASK_H
 #define TASK_H
 
+#include "isr.h"
+#include "kstack.h"
 #include "paging.h"
+#include "spinlock.h"
 
-/** Use a 2kB kernel stack. */
-#define KERNEL_STACK_SIZE 2048
+/** Top of the stack of the first task, moved there from the boot stack. */
+#define BOOT_STACK_TOP      0xE0000000
+/** Size of the stack of the first task. */
+#define BOOT_STACK_SIZE     0x2000
+
+/** Resource usage of a task. */
+typedef struct {
+    /** Timer ticks spent in user mode. */
+    u32int utime;
+    /** Timer ticks spent in kernel mode. */
+    u32int stime;
+    /** Number of times the task gave up the processor itself. */
+    u32int nvcsw;
+    /** Number of times the task was preempted. */
+    u32int nivcsw;
+    /** Number of page faults. */
+    u32int page_faults;
+    /** Number of system calls. */
+    u32int syscalls;
+    /** Largest number of pages seen in the private part of the address
+     * space. */
+    u32int maxrss;
+} rusage_t;
 
 /** This structure defines a 'task' – a process. */
 typedef struct task {
@@ -27,24 +51,141 @@ typedef struct task {
     u32int kernel_stack;
     /** The next task in a linked list. */
     struct task *next;
+    /** Index of the processor whose ready queue holds the task. */
+    u32int cpu;
+    /** The next task in the list of exited kernel threads. */
+    struct task *next_dead;
+    /** The next task in the list of all tasks. */
+    struct task *next_all;
+    /** Resource usage counters. */
+    rusage_t usage;
+    /** Submission and completion rings set up by the task, if any. */
+    struct uring *uring;
+    /** Set when the system calls of the task are traced. */
+    u32int trace;
 } task_t;
 
+/** Entry point of a kernel thread. */
+typedef void (*kthread_fn_t)(void *arg);
+
 /**
  * Initialises the tasking system.
  */
 void initialise_tasking(void);
 
 /**
- * Call by the timer hook, this changes the running process.
+ * Initialises tasking on an application processor. The code calling this
+ * function becomes the idle task of the processor.
+ *
+ * @param stack     the stack the processor is running on
+ */
+void initialise_tasking_ap(u32int stack);
+
+/**
+ * Body of the idle task of a processor: release the kernel threads that
+ * exited on it and wait for interrupts, forever.
+ */
+void cpu_idle(void) NORETURN;
+
+/**
+ * Call by the timer hook, this changes the running process. A processor
+ * with nothing to run steals a task from the busiest processor.
  */
 void switch_task(void);
 
+/**
+ * Give up the processor voluntarily.
+ */
+void yield(void);
+
+/**
+ * Block the current task for at least given time. Interrupts must be
+ * enabled.
+ *
+ * @param ms    number of milliseconds to sleep
+ */
+void sleep(u32int ms);
+
+/**
+ * Take the current task off the ready queue until wake_up() is called for
+ * it. Must be called with interrupts disabled and `lock` held; the lock is
+ * released once the task is off the queue, so a waker holding it can not
+ * miss the task. Returns with interrupts still disabled.
+ *
+ * @param lock  lock protecting the condition waited for
+ */
+void block_task(spinlock_t *lock);
+
+/**
+ * Put a task blocked by block_task() back on the ready queue.
+ *
+ * @param task  the blocked task
+ */
+void wake_up(task_t *task);
+
+/**
+ * Charge one timer tick to the current task. Call by the timer hooks.
+ *
+ * @param regs  registers of the interrupted code
+ */
+void account_tick(registers_t *regs);
+
+/**
+ * Get the task running on this processor.
+ *
+ * @return the current task, or null if tasking is not initialised
+ */
+task_t *get_current_task(void);
+
+/**
+ * Retrieve resource usage of a task.
+ *
+ * @param pid       process ID, or 0 for the current task
+ * @param[out] usage where to store the counters
+ * @return 0 on success, -ESRCH if there is no such task
+ */
+int getrusage(int pid, rusage_t *usage);
+
+/**
+ * Turn tracing of the system calls of a task on or off.
+ *
+ * @param pid   process ID, or 0 for the current task
+ * @param on    nonzero to trace the task
+ * @return 0 on success, -ESRCH if there is no such task
+ */
+int trace_task(int pid, u32int on);
+
+/**
+ * Print resource usage of all tasks to the monitor.
+ */
+void dump_tasks(void);
+
 /**
  * Forks the current process, spawning a new one with a different
  * memory space.
  */
 int fork(void);
 
+/**
+ * Creates a kernel thread running `fn(arg)`.
+ *
+ * Unlike fork(), no address space is cloned: the thread gets only a task
+ * structure and a kernel stack, and runs on the page directory of its
+ * creator. When `fn` returns, the thread exits.
+ *
+ * @param fn    function to run in the new thread
+ * @param arg   argument passed to `fn`
+ * @return      the new task, already on the ready queue
+ */
+task_t *kthread_create(kthread_fn_t fn, void *arg);
+
+/**
+ * Terminates the calling kernel thread. Its stack and task structure are
+ * released by the idle task or a later kthread_create() on the same
+ * processor.
+ */
+void kthread_exit(void) NORETURN;
+
 /**
  * Causes the current process's stack to be forcibly move to a new location.
  *
@@ -0,0 +1,195 @@
+/*
+ * timer-wheel.c -- Defines kernel timers kept in a hierarchical timer wheel.
+ *
+ * The wheel has four levels of 64 slots. Level 0 holds timers expiring
+ * within the next 64 ticks, one slot per tick. Each slot of level n covers
+ * 64^n ticks. Whenever the lower level wraps around, the timers of the next
+ * slot of the level above are cascaded down. Timers further away than the
+ * wheel can hold are put in its last slot and cascaded until they expire.
+ */
+
+#include "timer-wheel.h"
+#include "spinlock.h"
+#include "timer.h"
+
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+#define MAX_TIMEOUT     ((1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static ktimer_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+/* All ticks before this one were processed. */
+static u32int wheel_tick;
+/* Protects the wheel and the timers in it. */
+static spinlock_t wheel_lock = SPINLOCK_INIT("timers");
+
+/*
+ * Put a timer in the slot matching its expiry time. The wheel must be
+ * locked.
+ */
+static void enqueue_timer(ktimer_t *timer)
+{
+    u32int expires = timer->expires;
+    u32int delta = expires - wheel_tick;
+    ktimer_t **slot;
+
+    if ((s32int) delta < 0) {
+        /* Already expired, run it on the next tick. */
+        slot = &wheel[0][wheel_tick & WHEEL_MASK];
+    } else {
+        if (delta > MAX_TIMEOUT) {
+            delta = MAX_TIMEOUT;
+            expires = wheel_tick + delta;
+        }
+        u32int level = 0;
+        while (delta >= (1u << (WHEEL_BITS * (level + 1))))
+            level++;
+        slot = &wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    }
+
+    timer->next = *slot;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/*
+ * Unlink a pending timer. The wheel must be locked.
+ */
+static void dequeue_timer(ktimer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = 0;
+    timer->pprev = 0;
+}
+
+/*
+ * Move all timers of a slot to lower levels. The wheel must be locked.
+ *
+ * @return index of the slot
+ */
+static u32int cascade(u32int level, u32int index)
+{
+    ktimer_t *timer = wheel[level][index];
+    wheel[level][index] = 0;
+    while (timer) {
+        ktimer_t *next = timer->next;
+        enqueue_timer(timer);
+        timer = next;
+    }
+    return index;
+}
+
+void init_ktimer(ktimer_t *timer, ktimer_fn_t fn, void *arg)
+{
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void add_timer(ktimer_t *timer)
+{
+    u32int flags = spin_lock_irqsave(&wheel_lock);
+    ASSERT(!timer->pprev);
+    enqueue_timer(timer);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    timer_deadline_added(timer->expires);
+}
+
+int del_timer(ktimer_t *timer)
+{
+    int pending = 0;
+    u32int flags = spin_lock_irqsave(&wheel_lock);
+    if (timer->pprev) {
+        dequeue_timer(timer);
+        pending = 1;
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return pending;
+}
+
+int mod_timer(ktimer_t *timer, u32int expires)
+{
+    int pending = 0;
+    u32int flags = spin_lock_irqsave(&wheel_lock);
+    if (timer->pprev) {
+        dequeue_timer(timer);
+        pending = 1;
+    }
+    timer->expires = expires;
+    enqueue_timer(timer);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    timer_deadline_added(expires);
+    return pending;
+}
+
+int timer_pending(ktimer_t *timer)
+{
+    return timer->pprev != 0;
+}
+
+int timer_next_expiry(u32int *expires)
+{
+    int found = 0;
+    u32int level, i;
+    u32int flags = spin_lock_irqsave(&wheel_lock);
+
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+        u32int bits = WHEEL_BITS * level;
+        u32int pos = wheel_tick >> bits;
+        /* Slots of upper levels are cascaded when the level below wraps
+         * to them, so the current slot is the farthest one. */
+        for (i = level ? 1 : 0; i <= WHEEL_SIZE; ++i) {
+            if (wheel[level][(pos + i) & WHEEL_MASK])
+                break;
+        }
+        if (i > WHEEL_SIZE)
+            continue;
+        /* For upper levels this is the time of the cascade, which comes
+         * before the timers in the slot expire. */
+        u32int when = (pos + i) << bits;
+        if (!found || (s32int) (when - *expires) < 0)
+            *expires = when;
+        found = 1;
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return found;
+}
+
+void run_timers(void)
+{
+    u32int flags = spin_lock_irqsave(&wheel_lock);
+    while (time_after_eq(tick, wheel_tick)) {
+        u32int index = wheel_tick & WHEEL_MASK;
+
+        /* Level 0 wrapped around, refill it from the levels above. */
+        u32int level = 1;
+        while (!index && level < WHEEL_LEVELS) {
+            index = cascade(level,
+                    (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+            level++;
+        }
+        index = wheel_tick & WHEEL_MASK;
+        wheel_tick++;
+
+        while (wheel[0][index]) {
+            ktimer_t *timer = wheel[0][index];
+            ktimer_fn_t fn = timer->fn;
+            void *arg = timer->arg;
+            dequeue_timer(timer);
+
+            /* The callback may add the timer again or free it. */
+            spin_unlock_irqrestore(&wheel_lock, flags);
+            fn(arg);
+            flags = spin_lock_irqsave(&wheel_lock);
+        }
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
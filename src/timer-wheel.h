@@ -0,0 +1,97 @@
+/**
+ * @file    timer-wheel.h
+ *
+ * Defines the interface to kernel timers.
+ *
+ * Timers are kept in a hierarchical timer wheel, so adding, removing and
+ * expiring a timer takes constant time. Expiry times are given in timer
+ * ticks. Callbacks run in the timer softirq of the boot processor, so they
+ * must not sleep.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "common.h"
+
+/** Callback of an expired timer. */
+typedef void (*ktimer_fn_t)(void *arg);
+
+/** A kernel timer. The structure is owned by the caller. */
+typedef struct ktimer {
+    /** Next timer in the same slot. */
+    struct ktimer *next;
+    /** Link pointing to this timer, null when it is not pending. */
+    struct ktimer **pprev;
+    /** Value of the tick when the timer expires. */
+    u32int expires;
+    /** Function called when the timer expires. */
+    ktimer_fn_t fn;
+    /** Argument passed to fn. */
+    void *arg;
+} ktimer_t;
+
+/**
+ * Check whether tick a is at or after tick b, handling wrap around.
+ */
+#define time_after_eq(a, b)     ((s32int) ((a) - (b)) >= 0)
+
+/**
+ * Prepare a timer. It must be called before any other function.
+ *
+ * @param timer     timer to initialise
+ * @param fn        function to call on expiry
+ * @param arg       argument passed to fn
+ */
+void init_ktimer(ktimer_t *timer, ktimer_fn_t fn, void *arg);
+
+/**
+ * Start a timer. The timer must not be pending. A timer whose expiry time
+ * has already passed fires on the next tick.
+ *
+ * @param timer     timer with expires set
+ */
+void add_timer(ktimer_t *timer);
+
+/**
+ * Stop a timer. The callback may still be running on return.
+ *
+ * @param timer     timer to stop
+ * @return nonzero if the timer was pending
+ */
+int del_timer(ktimer_t *timer);
+
+/**
+ * Change expiry time of a timer, starting it if it is not pending.
+ *
+ * @param timer     timer to modify
+ * @param expires   new expiry tick
+ * @return nonzero if the timer was pending
+ */
+int mod_timer(ktimer_t *timer, u32int expires);
+
+/**
+ * Check whether a timer is waiting to expire.
+ *
+ * @param timer     timer to check
+ * @return nonzero if the timer is pending
+ */
+int timer_pending(ktimer_t *timer);
+
+/**
+ * Find the earliest tick at which the wheel has work to do. It may be
+ * earlier than the expiry of any timer, when timers have to be moved to
+ * lower levels of the wheel first.
+ *
+ * @param[out] expires  where to store the tick
+ * @return nonzero if any timer is pending
+ */
+int timer_next_expiry(u32int *expires);
+
+/**
+ * Run callbacks of all timers that expired up to the current tick. Called
+ * by the timer softirq.
+ */
+void run_timers(void);
+
+#endif /* end of include guard: TIMER_WHEEL_H */
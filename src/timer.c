@@ -4,13 +4,16 @@
  */
 
 #include "timer.h"
+#include "apic.h"
+#include "clock.h"
 #include "isr.h"
+#include "monitor.h"
+#include "profile.h"
+#include "smp.h"
+#include "softirq.h"
 #include "task.h"
-
-/**
- * This is the frequency of PIT internal clock.
- */
-#define PIT_FREQ    1193180
+#include "timer-wheel.h"
+#include "vdso.h"
 
 /*
  * These are the I/O ports for setting the PIT.
@@ -66,23 +69,172 @@
 #define PIT_BINARY      0x00
 #define PIT_BCD         0x01
 
-u32int tick = 0;
+/* Port B of the keyboard controller, it controls gate of PIT channel 2. */
+#define PORT_B          0x61
+#define PORT_B_GATE2    0x01
+#define PORT_B_SPEAKER  0x02
+#define PORT_B_OUT2     0x20
+
+volatile u32int tick = 0;
+u32int timer_frequency = 0;
+
+/* Set once the one-shot Local APIC timers replace the periodic tick. */
+static int tickless = 0;
+/* Length of a tick in nanoseconds. */
+static u32int tick_ns;
+/* Difference between tick and the tick computed from the clock. */
+static u32int tick_offset;
+/* Tick the boot processor is programmed to wake up at for the timer
+ * wheel, valid if wheel_armed is set. */
+static volatile u32int wheel_deadline;
+static volatile int wheel_armed;
+
+u32int timer_ticks(void)
+{
+    /* The time stamp counters of all processors are assumed to be
+     * synchronised, so any of them may update the tick. */
+    if (tickless)
+        tick = (u32int) div_u64_u32(ktime_ns(), tick_ns, 0) + tick_offset;
+    return tick;
+}
+
+/*
+ * Send the timer interrupt to an idle processor, which then steals some
+ * work from the executing one.
+ */
+static void kick_idle_cpu(cpu_t *self)
+{
+    u32int i;
+    for (i = 0; i < MAX_CPUS; ++i) {
+        cpu_t *cpu = &cpus[i];
+        if (cpu != self && cpu->online && !cpu->nr_tasks &&
+                cpu->current == cpu->idle_task) {
+            lapic_send_fixed(cpu->apic_id, LAPIC_TIMER_VECTOR);
+            return;
+        }
+    }
+}
+
+/*
+ * Program the Local APIC timer of the executing processor for its next
+ * event: the end of the time slice when more tasks are waiting for it, the
+ * next tick when softirqs were left pending, the next profiler sample, and
+ * on the boot processor the next timer wheel deadline. With none of them,
+ * the timer is stopped and the processor sleeps until an interrupt arrives.
+ * Must be called with interrupts disabled.
+ */
+static void timer_reprogram(void)
+{
+    cpu_t *cpu = this_cpu();
+    u64int now = ktime_ns();
+    u64int deadline = 0;
+
+    if (cpu->nr_tasks > 1 || (cpu->nr_tasks && cpu->current == cpu->idle_task)) {
+        deadline = now + tick_ns;
+        if (cpu->nr_tasks > 1)
+            kick_idle_cpu(cpu);
+    }
+    if (cpu->softirq_pending)
+        deadline = now + tick_ns;
+
+    u64int sample = profile_deadline();
+    if (sample && (!deadline || sample < deadline))
+        deadline = sample;
+
+    u32int expires;
+    if (!cpu->index)
+        wheel_armed = timer_next_expiry(&expires);
+    if (!cpu->index && wheel_armed) {
+        wheel_deadline = expires;
+        /* Convert the tick to time, relative to the start of the current
+         * tick, so that wrapping of the tick does not matter. */
+        u32int rem;
+        u32int now_tick = (u32int) div_u64_u32(now, tick_ns, &rem)
+            + tick_offset;
+        s32int delta = expires - now_tick;
+        u64int when = now - rem + (delta > 0 ? (u64int) delta * tick_ns : 0);
+        if (!deadline || when < deadline)
+            deadline = when;
+    }
+
+    if (!deadline)
+        lapic_timer_stop();
+    else
+        lapic_timer_oneshot(deadline > now ? deadline - now : 0);
+}
+
+void timer_kick(cpu_t *cpu)
+{
+    if (!tickless)
+        return;
+    if (cpu == this_cpu()) {
+        u32int flags = irq_save();
+        timer_reprogram();
+        irq_restore(flags);
+    } else {
+        lapic_send_fixed(cpu->apic_id, LAPIC_TIMER_VECTOR);
+    }
+}
+
+void timer_deadline_added(u32int expires)
+{
+    /* The boot processor runs the wheel, it only needs to know about
+     * deadlines earlier than the one it waits for. */
+    if (tickless && !(wheel_armed && time_after_eq(expires, wheel_deadline)))
+        timer_kick(&cpus[0]);
+}
+
+/*
+ * Timer interrupt of all processors, from the PIT or the Local APIC.
+ */
+static void timer_interrupt(registers_t *regs)
+{
+    cpu_t *cpu = this_cpu();
+    timer_ticks();
+    account_tick(regs);
+    profile_tick(regs);
+
+    /* The boot processor reprograms its timer once the expired timers
+     * ran, as they are the next deadline. */
+    if (!cpu->index)
+        raise_softirq(TIMER_SOFTIRQ);
+    else if (tickless)
+        timer_reprogram();
+    cpu->need_resched = 1;
+}
+
+/*
+ * Timer softirq of the boot processor.
+ */
+static void timer_softirq(void)
+{
+    run_timers();
+    if (tickless) {
+        u32int flags = irq_save();
+        timer_reprogram();
+        irq_restore(flags);
+    }
+}
 
 static void timer_callback(registers_t *regs)
 {
     tick++;
-    switch_task();
+    vdso_set_tick(tick);
+    timer_interrupt(regs);
 }
 
 void init_timer(u32int frequency)
 {
-    /* Register the callback. */
+    /* Register the callbacks. */
     register_interrupt_handler(IRQ0, &timer_callback);
+    register_interrupt_handler(LAPIC_TIMER_VECTOR, &timer_interrupt);
+    open_softirq(TIMER_SOFTIRQ, &timer_softirq);
 
     /* This is the value to be sent to PIT to get required frequency.
      * Important to note is that the divisor must be small enough to fit
      * into 16 bits. */
     u32int divisor = PIT_FREQ / frequency;
+    timer_frequency = frequency;
 
     /* Send the command byte. */
     outb(PIT_CTRL, PIT_BINARY | PIT_MODE_2 | PIT_AM_LOHI | PIT_CHANNEL_0);
@@ -91,3 +243,52 @@ void init_timer(u32int frequency)
     outb(PIT_DATA_0, divisor & 0xFF);           /* Low byte */
     outb(PIT_DATA_0, (divisor >> 8) & 0xFF);    /* High byte */
 }
+
+void init_tickless(void)
+{
+    if (!lapic_present() || !clock_khz())
+        return;
+
+    u32int flags = irq_save();
+
+    /* Continue counting from the current tick. */
+    tick_ns = NSEC_PER_SEC / timer_frequency;
+    tick_offset = tick - (u32int) div_u64_u32(ktime_ns(), tick_ns, 0);
+    tickless = 1;
+    vdso_set_tickless(tick_ns, tick_offset);
+
+    /* Silence the PIT and switch every processor to one-shot mode. */
+    irq_mask(0);
+    u32int i;
+    for (i = 0; i < MAX_CPUS; ++i) {
+        if (cpus[i].online)
+            timer_kick(&cpus[i]);
+    }
+
+    irq_restore(flags);
+    monitor_write("Timer: tickless mode\n");
+}
+
+u32int msecs_to_ticks(u32int ms)
+{
+    /* Round up, so that a sleep is never shorter than requested. */
+    return (ms * timer_frequency + 999) / 1000;
+}
+
+void pit_oneshot_start(u16int count)
+{
+    /* Enable the gate and keep the speaker disconnected. */
+    u8int portb = inb(PORT_B);
+    outb(PORT_B, (portb & ~PORT_B_SPEAKER) | PORT_B_GATE2);
+
+    /* In mode 0, the output goes low and rises when the count reaches
+     * zero. Counting starts once the high byte is written. */
+    outb(PIT_CTRL, PIT_BINARY | PIT_MODE_0 | PIT_AM_LOHI | PIT_CHANNEL_2);
+    outb(PIT_DATA_2, count & 0xFF);
+    outb(PIT_DATA_2, (count >> 8) & 0xFF);
+}
+
+int pit_oneshot_expired(void)
+{
+    return (inb(PORT_B) & PORT_B_OUT2) != 0;
+}
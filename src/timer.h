@@ -13,6 +13,14 @@
 #define TIMER_H
 
 #include "common.h"
+#include "smp.h"
+
+/**
+ * Number of timer interrupts since boot. It is volatile, as code waiting
+ * for a tick polls it. In tickless mode it is only brought up to date by
+ * timer_ticks(), use that function unless the tick is known periodic.
+ */
+extern volatile u32int tick;
 
 /**
  * Initialize timer to fire with given frequency.
@@ -23,4 +31,63 @@
  */
 void init_timer(u32int frequency);
 
+/**
+ * Stop the periodic tick and drive the timers of all processors by
+ * one-shot Local APIC timers, which fire only at the end of a time slice
+ * or at a timer deadline. An idle processor with no timers takes no
+ * interrupts. It needs the Local APIC and the time stamp counter; without
+ * them the tick stays periodic. Call after initialise_smp().
+ */
+void init_tickless(void);
+
+/**
+ * Get the current tick. In tickless mode the tick is computed from the
+ * clock, as there is no interrupt counting it.
+ *
+ * @return current value of the tick
+ */
+u32int timer_ticks(void);
+
+/**
+ * Make a processor reconsider when its next timer interrupt should come,
+ * after its ready queue changed. Does nothing unless in tickless mode.
+ *
+ * @param cpu   processor whose queue changed
+ */
+void timer_kick(cpu_t *cpu);
+
+/**
+ * Tell the boot processor, which runs the timer wheel, that a timer was
+ * added. Called by the timer wheel.
+ *
+ * @param expires   expiry tick of the timer
+ */
+void timer_deadline_added(u32int expires);
+
+/**
+ * Convert time to the number of timer ticks, rounding up.
+ *
+ * @param ms    time in milliseconds
+ * @return number of ticks
+ */
+u32int msecs_to_ticks(u32int ms);
+
+/** Frequency of the PIT internal clock in Hz. */
+#define PIT_FREQ    1193180
+
+/**
+ * Start PIT channel 2 counting down from given value. It does not raise any
+ * interrupt, use pit_oneshot_expired() to poll for the end of the count.
+ *
+ * @param count     number of PIT_FREQ periods to count
+ */
+void pit_oneshot_start(u16int count);
+
+/**
+ * Check whether the count started by pit_oneshot_start() reached zero.
+ *
+ * @return nonzero if the count has expired
+ */
+int pit_oneshot_expired(void);
+
 #endif /* end of include guard: TIMER_H */
@@ -0,0 +1,222 @@
+/*
+ * uring.c -- Defines the submission and completion rings for batched
+ *            system calls.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "fs.h"
+#include "kheap.h"
+#include "monitor.h"
+#include "paging.h"
+#include "smp.h"
+#include "task.h"
+#include "timer.h"
+#include "uring.h"
+
+/* Rings of one task, private to the kernel. The sizes and the indices
+ * owned by the kernel are kept here, the copies in the shared memory are
+ * only published for the task, which may overwrite them. */
+typedef struct uring {
+    uring_shared_t *shared;
+    uring_sqe_t *sqes;
+    uring_cqe_t *cqes;
+    u32int sq_entries;
+    u32int cq_entries;
+    u32int sq_head;
+    u32int cq_tail;
+    /* Polling thread, if any. */
+    task_t *sqpoll;
+    /* Protects sleeping. */
+    spinlock_t lock;
+    /* Set while the polling thread is blocked. */
+    u32int sleeping;
+} uring_t;
+
+/* Order the store of a flag before the load of an index, which x86 does
+ * not do on its own. */
+#define mb()    asm volatile ("lock; addl $0, (%%esp)" ::: "memory")
+
+/*
+ * Run one operation. The entry was copied out of the shared memory, so the
+ * task can not change it while it is checked and used. Everything the
+ * entry points to must be accessible from user mode.
+ */
+static s32int uring_op(uring_sqe_t *sqe)
+{
+    const char *path = (const char *) sqe->path;
+    fs_node_t *node;
+    u32int flags;
+
+    switch (sqe->opcode) {
+    case URING_OP_NOP:
+        return 0;
+    case URING_OP_WRITE:
+        if (!user_string_ok((const char *) sqe->addr))
+            return -EFAULT;
+        monitor_write((const char *) sqe->addr);
+        return 0;
+    case URING_OP_READ:
+        if (!user_string_ok(path)
+                || !user_range_ok((void *) sqe->addr, sqe->len, 1))
+            return -EFAULT;
+        node = lookup_fs(fs_root, path);
+        if (!node)
+            return -ENOENT;
+        return read_fs(node, sqe->off, sqe->len, (u8int *) sqe->addr);
+    case URING_OP_SLEEP:
+        /* System calls run with interrupts disabled. */
+        flags = irq_save();
+        asm volatile ("sti");
+        sleep(sqe->off);
+        irq_restore(flags);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+/*
+ * Run queued operations until the submission ring is empty or the
+ * completion ring is full.
+ */
+static u32int uring_submit(uring_t *ring)
+{
+    uring_shared_t *sh = ring->shared;
+    u32int sq_mask = ring->sq_entries - 1, cq_mask = ring->cq_entries - 1;
+    u32int done = 0;
+
+    /* A bogus tail from the task must not make us loop for long. */
+    u32int queued = sh->sq_tail - ring->sq_head;
+    if (queued > ring->sq_entries)
+        queued = ring->sq_entries;
+
+    while (done < queued) {
+        if (ring->cq_tail - sh->cq_head >= ring->cq_entries)
+            break;
+        /* Read the entry only after its index. */
+        asm volatile ("" ::: "memory");
+
+        uring_sqe_t sqe = ring->sqes[ring->sq_head & sq_mask];
+        sh->sq_head = ++ring->sq_head;
+
+        uring_cqe_t *cqe = &ring->cqes[ring->cq_tail & cq_mask];
+        cqe->user_data = sqe.user_data;
+        cqe->res = uring_op(&sqe);
+        /* The entry must be complete before the task can see it. */
+        asm volatile ("" ::: "memory");
+        sh->cq_tail = ++ring->cq_tail;
+        done++;
+    }
+    return done;
+}
+
+/*
+ * Body of the polling thread. It spins while there is work and sleeps once
+ * there was none for URING_SQPOLL_IDLE milliseconds.
+ */
+static void sqpoll_thread(void *arg)
+{
+    uring_t *ring = arg;
+    uring_shared_t *sh = ring->shared;
+    u32int idle = msecs_to_ticks(URING_SQPOLL_IDLE);
+    u32int last_work = timer_ticks();
+
+    for (;;) {
+        if (uring_submit(ring)) {
+            last_work = timer_ticks();
+            continue;
+        }
+        if (timer_ticks() - last_work < idle) {
+            yield();
+            continue;
+        }
+
+        u32int flags = spin_lock_irqsave(&ring->lock);
+        sh->flags |= URING_SQ_NEED_WAKEUP;
+        /* The task may have queued entries before it could see the flag. */
+        mb();
+        if (ring->sq_head != sh->sq_tail) {
+            sh->flags &= ~URING_SQ_NEED_WAKEUP;
+            spin_unlock_irqrestore(&ring->lock, flags);
+            continue;
+        }
+        ring->sleeping = 1;
+        block_task(&ring->lock);
+        irq_restore(flags);
+        last_work = timer_ticks();
+    }
+}
+
+int uring_setup(u32int entries, u32int flags, uring_shared_t **ring_ptr)
+{
+    task_t *task = get_current_task();
+    if (!task)
+        return -EINVAL;
+    if (!entries || entries > URING_MAX_ENTRIES || entries & (entries - 1))
+        return -EINVAL;
+    if (task->uring)
+        return -EBUSY;
+
+    /* The shared memory gets pages of its own, mapped writable for user
+     * mode in the address space of the task only. The kernel uses the same
+     * mapping, it runs on that address space whenever it touches the rings. */
+    u32int sq_off = sizeof(uring_shared_t);
+    u32int cq_off = sq_off + entries * sizeof(uring_sqe_t);
+    u32int size = cq_off + 2 * entries * sizeof(uring_cqe_t);
+    size = (size + 0xFFF) & 0xFFFFF000;
+
+    u32int addr;
+    for (addr = URING_ADDR; addr < URING_ADDR + size; addr += 0x1000)
+        alloc_frame(get_page(addr, 1, task->page_directory), 0, 1);
+
+    uring_t *ring = kmalloc(sizeof(uring_t));
+    uring_shared_t *sh = (uring_shared_t *) URING_ADDR;
+    memset(sh, 0, size);
+    sh->sq_entries = entries;
+    sh->cq_entries = 2 * entries;
+    sh->sq_off = sq_off;
+    sh->cq_off = cq_off;
+
+    ring->shared = sh;
+    ring->sqes = (uring_sqe_t *) ((u32int) sh + sq_off);
+    ring->cqes = (uring_cqe_t *) ((u32int) sh + cq_off);
+    ring->sq_entries = entries;
+    ring->cq_entries = 2 * entries;
+    ring->sq_head = ring->cq_tail = 0;
+    ring->sqpoll = 0;
+    ring->sleeping = 0;
+    spin_init(&ring->lock, "uring");
+    task->uring = ring;
+
+    /* The thread inherits the page directory of the task, so the buffers
+     * of the task are reachable from it. */
+    if (flags & URING_SETUP_SQPOLL)
+        ring->sqpoll = kthread_create(&sqpoll_thread, ring);
+
+    *ring_ptr = sh;
+    return 0;
+}
+
+int uring_enter(u32int flags)
+{
+    task_t *task = get_current_task();
+    if (!task || !task->uring)
+        return -EINVAL;
+    uring_t *ring = task->uring;
+
+    if (!ring->sqpoll)
+        return uring_submit(ring);
+
+    if (flags & URING_ENTER_SQ_WAKEUP) {
+        u32int irq = spin_lock_irqsave(&ring->lock);
+        if (ring->sleeping) {
+            ring->sleeping = 0;
+            ring->shared->flags &= ~URING_SQ_NEED_WAKEUP;
+            wake_up(ring->sqpoll);
+        }
+        spin_unlock_irqrestore(&ring->lock, irq);
+    }
+    return 0;
+}
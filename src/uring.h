@@ -0,0 +1,122 @@
+/**
+ * @file    uring.h
+ *
+ * Defines shared memory rings for submitting system calls in batches.
+ *
+ * A task sets up a pair of rings with uring_setup(). It queues operations
+ * in the submission ring and finds their results in the completion ring,
+ * both living in memory shared with the kernel. One uring_enter() runs
+ * everything queued so far. With #URING_SETUP_SQPOLL a kernel thread polls
+ * the submission ring instead, so no trap is needed at all while it is
+ * awake. When the thread went to sleep it sets #URING_SQ_NEED_WAKEUP and
+ * has to be woken by uring_enter() with #URING_ENTER_SQ_WAKEUP.
+ *
+ * The task owns sq_tail and cq_head, the kernel owns sq_head and cq_tail.
+ * Indices run freely and are masked with the ring size when used. The
+ * kernel keeps its own copy of everything it owns, changing it in the
+ * shared memory has no effect.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "common.h"
+
+#define URING_OP_NOP        0   /**< Do nothing */
+#define URING_OP_WRITE      1   /**< Write the string at addr to the monitor */
+#define URING_OP_READ       2   /**< Read len bytes at off of the file named
+                                     path into addr */
+#define URING_OP_SLEEP      3   /**< Sleep for off milliseconds */
+
+/** Poll the submission ring from a kernel thread. */
+#define URING_SETUP_SQPOLL  0x1
+
+/** Wake the polling thread. */
+#define URING_ENTER_SQ_WAKEUP   0x1
+
+/** Set in flags while the polling thread sleeps. */
+#define URING_SQ_NEED_WAKEUP    0x1
+
+/** Largest number of submission entries. */
+#define URING_MAX_ENTRIES   256
+
+/** Address of the shared memory in the task. It must not share a page
+ * table with the kernel, which the table of the vDSO page above it does. */
+#define URING_ADDR          0xBF800000
+
+/** Milliseconds without work after which the polling thread sleeps. */
+#define URING_SQPOLL_IDLE   100
+
+/** Operation queued in the submission ring. */
+typedef struct {
+    /** One of the URING_OP_ codes. */
+    u32int opcode;
+    /** Address of the buffer. */
+    u32int addr;
+    /** Length of the buffer. */
+    u32int len;
+    /** File offset, or time for #URING_OP_SLEEP. */
+    u32int off;
+    /** Address of the file name. */
+    u32int path;
+    /** Copied to the completion entry untouched. */
+    u32int user_data;
+} uring_sqe_t;
+
+/** Result of an operation in the completion ring. */
+typedef struct {
+    /** user_data of the submission entry. */
+    u32int user_data;
+    /** Result of the operation or a negated error number. */
+    s32int res;
+} uring_cqe_t;
+
+/** Header of the memory shared by the task and the kernel. The entries
+ * are found at the given offsets from its start. */
+typedef struct {
+    /** Next submission entry the kernel takes. */
+    volatile u32int sq_head;
+    /** Next free submission entry. */
+    volatile u32int sq_tail;
+    /** Next completion entry the task reads. */
+    volatile u32int cq_head;
+    /** Next free completion entry. */
+    volatile u32int cq_tail;
+    /** Number of submission entries, a power of two. */
+    u32int sq_entries;
+    /** Number of completion entries, twice sq_entries. */
+    u32int cq_entries;
+    /** URING_SQ_ flags. */
+    volatile u32int flags;
+    /** Offset of the submission entries. */
+    u32int sq_off;
+    /** Offset of the completion entries. */
+    u32int cq_off;
+} uring_shared_t;
+
+struct uring;
+
+/**
+ * Set up rings for the current task. The shared memory is mapped at
+ * #URING_ADDR in the address space of the task, where the kernel uses it
+ * too. The polling thread, if asked for, runs on the address space of the
+ * task.
+ *
+ * @param entries   number of submission entries, a power of two up to
+ *                  #URING_MAX_ENTRIES
+ * @param flags     URING_SETUP_ flags
+ * @param[out] ring where to store the address of the shared memory
+ * @return 0 on success, or a negated error number
+ */
+int uring_setup(u32int entries, u32int flags, uring_shared_t **ring);
+
+/**
+ * Run the operations queued by the current task, or wake its polling
+ * thread.
+ *
+ * @param flags     URING_ENTER_ flags
+ * @return number of operations run, or a negated error number
+ */
+int uring_enter(u32int flags);
+
+#endif /* end of include guard: URING_H */
@@ -0,0 +1,154 @@
+/*
+ * vdso.c -- Defines the page of kernel data readable by user code, and the
+ *           user side functions reading it.
+ */
+
+#include "descriptor-tables.h"
+#include "vdso.h"
+
+/* The page lies in the kernel image, which is identity mapped, so the
+ * kernel writes it at its own address and needs no frame for it. */
+static union {
+    vdso_data_t data;
+    u8int page[0x1000];
+} vdso_page ALIGNED(0x1000);
+
+/* The user side reads the page where user mode can see it. */
+#define vdso    ((const vdso_data_t *) VDSO_ADDR)
+
+#define barrier()   asm volatile ("" ::: "memory")
+
+void map_vdso(page_directory_t *dir)
+{
+    page_t *page = get_page(VDSO_ADDR, 1, dir);
+    page->present = 1;
+    page->rw      = 0;
+    page->user    = 1;
+    page->frame   = (u32int) &vdso_page / 0x1000;
+}
+
+/*
+ * The clock parameters only change during boot, on the boot processor, so
+ * there is never more than one writer.
+ */
+static void write_begin(void)
+{
+    vdso_page.data.seq++;
+    barrier();
+}
+
+static void write_end(void)
+{
+    barrier();
+    vdso_page.data.seq++;
+}
+
+void vdso_set_clock(u32int khz, u64int base, u32int mult, u32int shift)
+{
+    write_begin();
+    vdso_page.data.cycles_khz  = khz;
+    vdso_page.data.cycles_base = base;
+    vdso_page.data.mult        = mult;
+    vdso_page.data.shift       = shift;
+    write_end();
+}
+
+void vdso_set_tickless(u32int tick_ns, u32int tick_offset)
+{
+    write_begin();
+    vdso_page.data.tick_ns     = tick_ns;
+    vdso_page.data.tick_offset = tick_offset;
+    vdso_page.data.tickless    = 1;
+    write_end();
+}
+
+void vdso_set_tick(u32int tick)
+{
+    vdso_page.data.tick = tick;
+}
+
+void vdso_set_pid(u32int cpu, u32int pid)
+{
+    vdso_page.data.pid_seq[cpu]++;
+    barrier();
+    vdso_page.data.pid[cpu] = pid;
+    barrier();
+    vdso_page.data.pid_seq[cpu]++;
+}
+
+/*
+ * Same as cycles_to_ns(), with the parameters read from the page.
+ */
+static u64int scale(u64int cycles, u32int mult, u32int shift)
+{
+    u64int hi = (cycles >> 32) * mult;
+    u64int lo = (cycles & 0xFFFFFFFF) * mult;
+    if (shift == 0)
+        return (hi << 32) + lo;
+    return (hi << (32 - shift)) + (lo >> shift);
+}
+
+u64int vdso_gettime(void)
+{
+    u32int seq, mult, shift;
+    u64int cycles;
+
+    do {
+        seq = vdso->seq;
+        barrier();
+        mult  = vdso->mult;
+        shift = vdso->shift;
+        if (vdso->cycles_khz)
+            cycles = rdtsc() - vdso->cycles_base;
+        else
+            cycles = vdso->tick - vdso->cycles_base;
+        barrier();
+    } while ((seq & 1) || seq != vdso->seq);
+
+    return scale(cycles, mult, shift);
+}
+
+u32int vdso_ticks(void)
+{
+    u32int seq, tickless, tick_ns, tick_offset;
+
+    do {
+        seq = vdso->seq;
+        barrier();
+        tickless    = vdso->tickless;
+        tick_ns     = vdso->tick_ns;
+        tick_offset = vdso->tick_offset;
+        barrier();
+    } while ((seq & 1) || seq != vdso->seq);
+
+    if (!tickless)
+        return vdso->tick;
+    return (u32int) div_u64_u32(vdso_gettime(), tick_ns, 0) + tick_offset;
+}
+
+/*
+ * The caller may be moved away from the processor it read the index of
+ * before it reads the pid. Any switch on that processor changes its
+ * sequence, and coming back to it takes a switch too, so an unchanged
+ * sequence and processor mean the pid was ours.
+ */
+int vdso_getpid(void)
+{
+    u32int cpu, seq, pid;
+
+    do {
+        cpu = vdso_getcpu();
+        seq = vdso->pid_seq[cpu];
+        barrier();
+        pid = vdso->pid[cpu];
+        barrier();
+    } while ((seq & 1) || seq != vdso->pid_seq[cpu] || cpu != vdso_getcpu());
+
+    return pid;
+}
+
+u32int vdso_getcpu(void)
+{
+    /* The segment holding the index is readable from user mode. */
+    return cpu_index();
+}
@@ -0,0 +1,123 @@
+/**
+ * @file    vdso.h
+ *
+ * Defines the page of kernel data readable by user code.
+ *
+ * The page is mapped read-only at #VDSO_ADDR in every address space and
+ * kept up to date by the kernel, so user code can read the time, the tick
+ * and its process ID without a system call. Values which belong together
+ * are guarded by a sequence count: the kernel makes it odd while it
+ * updates them and readers retry when it was odd or changed under them.
+ * The vdso_ functions without the set prefix are the user side.
+ */
+
+#ifndef VDSO_H
+#define VDSO_H
+
+#include "common.h"
+#include "paging.h"
+#include "smp.h"
+
+/** Address of the page in every address space. */
+#define VDSO_ADDR   0xBFFFF000
+
+/** Layout of the page. */
+typedef struct {
+    /** Odd while the kernel updates the fields below it. */
+    volatile u32int seq;
+    /** Time stamp counter cycles per millisecond, zero if the clock
+     * counts ticks. */
+    u32int cycles_khz;
+    /** Counter value at which the clock started. */
+    u64int cycles_base;
+    /** Nanoseconds are (cycles * mult) >> shift. */
+    u32int mult;
+    /** See mult. */
+    u32int shift;
+    /** Set when the tick is derived from the clock. */
+    u32int tickless;
+    /** Length of a tick in tickless mode. */
+    u32int tick_ns;
+    /** Tick at clock time zero in tickless mode. */
+    u32int tick_offset;
+    /** The tick, in periodic mode. */
+    volatile u32int tick;
+    /** Process ID of the task running on each processor. */
+    volatile u32int pid[MAX_CPUS];
+    /** Bumped by every task switch on each processor, odd while pid is
+     * updated. */
+    volatile u32int pid_seq[MAX_CPUS];
+} vdso_data_t;
+
+/**
+ * Map the page into a page directory. Called for the kernel directory,
+ * whose table of the page all other directories share.
+ *
+ * @param dir   directory to map the page in
+ */
+void map_vdso(page_directory_t *dir);
+
+/**
+ * Publish parameters of the clock.
+ *
+ * @param khz   cycles per millisecond, zero if the clock counts ticks
+ * @param base  counter value at which the clock started
+ * @param mult  multiplier from cycles to nanoseconds
+ * @param shift shift from cycles to nanoseconds
+ */
+void vdso_set_clock(u32int khz, u64int base, u32int mult, u32int shift);
+
+/**
+ * Publish how the tick is derived from the clock in tickless mode.
+ *
+ * @param tick_ns       length of a tick in nanoseconds
+ * @param tick_offset   tick at clock time zero
+ */
+void vdso_set_tickless(u32int tick_ns, u32int tick_offset);
+
+/**
+ * Publish the tick. Only needed in periodic mode.
+ *
+ * @param tick  current tick
+ */
+void vdso_set_tick(u32int tick);
+
+/**
+ * Publish the task running on a processor. Called by every task switch,
+ * on the processor itself.
+ *
+ * @param cpu   index of the processor
+ * @param pid   process ID of the task
+ */
+void vdso_set_pid(u32int cpu, u32int pid);
+
+/**
+ * Get the time since boot, without a system call.
+ *
+ * @return time in nanoseconds
+ */
+u64int vdso_gettime(void);
+
+/**
+ * Get the tick, without a system call.
+ *
+ * @return current tick
+ */
+u32int vdso_ticks(void);
+
+/**
+ * Get the process ID of the caller, without a system call.
+ *
+ * @return process ID
+ */
+int vdso_getpid(void);
+
+/**
+ * Get the index of the processor running the caller. The caller may be
+ * moved to another processor at any time, so the result is only a hint.
+ *
+ * @return index of the processor
+ */
+u32int vdso_getcpu(void);
+
+#endif /* end of include guard: VDSO_H */
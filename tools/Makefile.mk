@@ -1,8 +1,12 @@
 CLEANTARGETS += tools/gen-initrd \
-		tools/gen-keymap
+		tools/gen-keymap \
+		tools/profile-report
 
 tools/gen-initrd : tools/gen-initrd.c
 	$(call cmd,$(CC) -Wall -o $@ $^,CC,$@)
 
 tools/gen-keymap : tools/gen-keymap.c
 	$(call cmd,$(CC) -Wall -o $@ $^,CC,$@)
+
+tools/profile-report : tools/profile-report.c
+	$(call cmd,$(CC) -Wall -o $@ $^,CC,$@)
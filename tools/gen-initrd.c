@@ -1,7 +1,31 @@
+/*
+ * gen-initrd.c -- Builds the initial ramdisk from pairs of a host file and
+ *                 its path in the ramdisk.
+ *
+ * By default the version 2 format is written: a header, a variable length
+ * entry table, a hash table and the names, followed by the file data, each
+ * file starting on a page boundary. Paths may contain directories. With -z
+ * files are compressed with LZ4 in blocks the kernel can decompress one by
+ * one. With -1 the original format with 64 fixed headers is written
+ * instead, which has no directories.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define PAGE_SIZE       4096
+
+#define INITRD2_MAGIC   0x32445249  /* "IRD2" */
+#define INITRD2_FILE    1
+#define INITRD2_DIR     2
+#define INITRD2_LZ4     4
+
+#define BLOCK_SIZE      4096
+
+/* Longest name the kernel keeps. */
+#define NAME_MAX        127
+
 struct initrd_header {
     unsigned char magic;
     char name[64];
@@ -9,46 +33,460 @@ struct initrd_header {
     unsigned int length;
 };
 
-int main(int argc, char *argv[])
+struct initrd2_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nentries;
+    unsigned int entries;
+    unsigned int hash;
+    unsigned int names;
+    unsigned int size;
+    unsigned int reserved;
+};
+
+struct initrd2_entry {
+    unsigned int name;
+    unsigned int flags;
+    unsigned int offset;
+    unsigned int length;
+    unsigned int crc;
+};
+
+/* Node of the tree being built. */
+struct node {
+    char name[NAME_MAX + 1];
+    int dir;
+    /* Host file of a file. */
+    const char *source;
+    /* First child and next sibling, indices into nodes or -1. */
+    int child, sibling, last_child;
+    /* Index in the entry table. */
+    int index;
+};
+
+static struct node *nodes;
+static int nnodes;
+
+/* Name of the entry holding the hash table of the file names. Kernels
+ * that do not know it just see one more file. */
+#define HASH_NAME ".hash"
+
+/* FNV-1a, must match initrd_hash() in the kernel. */
+static unsigned int hash_name(const char *name)
+{
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* CRC-32 as used by zlib, must match crc32() in the kernel. */
+static unsigned int crc32(const unsigned char *p, unsigned int len)
+{
+    unsigned int crc = 0xFFFFFFFF;
+    int k;
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static unsigned int put_length(unsigned char *dst, unsigned int out,
+                               unsigned int n)
+{
+    while (n >= 255) {
+        dst[out++] = 255;
+        n -= 255;
+    }
+    dst[out++] = n;
+    return out;
+}
+
+/*
+ * Write one LZ4 sequence: literals, then a match unless mlen is zero.
+ */
+static unsigned int lz4_sequence(unsigned char *dst, unsigned int out,
+                                 const unsigned char *lit, unsigned int nlit,
+                                 unsigned int dist, unsigned int mlen)
+{
+    unsigned int ml = mlen ? mlen - 4 : 0;
+    dst[out++] = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15)
+        out = put_length(dst, out, nlit - 15);
+    memcpy(dst + out, lit, nlit);
+    out += nlit;
+    if (mlen) {
+        dst[out++] = dist & 0xFF;
+        dst[out++] = dist >> 8;
+        if (ml >= 15)
+            out = put_length(dst, out, ml - 15);
+    }
+    return out;
+}
+
+/*
+ * Compress len bytes into an LZ4 block, greedily taking the last earlier
+ * position with the same hash of four bytes. dst must hold len + len / 255
+ * + 16 bytes.
+ */
+static unsigned int lz4_compress(const unsigned char *src, unsigned int len,
+                                 unsigned char *dst)
+{
+    int table[1 << 12];
+    unsigned int anchor = 0, i = 0, out = 0;
+
+    memset(table, 0xFF, sizeof(table));
+    /* The format wants the last match to start 12 bytes and end 5 bytes
+     * before the end. */
+    while (len >= 12 && i <= len - 12) {
+        unsigned int seq, h, mlen = 4;
+        int ref;
+
+        memcpy(&seq, src + i, 4);
+        h = (seq * 2654435761u) >> 20;
+        ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > 0xFFFF || memcmp(src + ref, src + i, 4)) {
+            i++;
+            continue;
+        }
+        while (i + mlen < len - 5 && src[ref + mlen] == src[i + mlen])
+            mlen++;
+        out = lz4_sequence(dst, out, src + anchor, i - anchor, i - ref, mlen);
+        i += mlen;
+        anchor = i;
+    }
+    return lz4_sequence(dst, out, src + anchor, len - anchor, 0, 0);
+}
+
+/*
+ * Compress a file block by block behind its block index. Returns zero if
+ * that does not make it smaller.
+ */
+static unsigned char *compress_file(const unsigned char *data,
+                                    unsigned int length, unsigned int *size)
+{
+    unsigned int nblocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE, i;
+    unsigned int *index;
+    unsigned char *out;
+
+    if (!nblocks)
+        return 0;
+    out = malloc((nblocks + 1) * sizeof(unsigned int)
+                 + nblocks * (BLOCK_SIZE + BLOCK_SIZE / 255 + 16));
+    index = (unsigned int *) out;
+    index[0] = (nblocks + 1) * sizeof(unsigned int);
+    for (i = 0; i < nblocks; ++i) {
+        const unsigned char *src = data + i * BLOCK_SIZE;
+        unsigned int len = length - i * BLOCK_SIZE, clen;
+        if (len > BLOCK_SIZE)
+            len = BLOCK_SIZE;
+
+        /* A block that does not shrink is stored as is, which the kernel
+         * tells from its size. */
+        clen = lz4_compress(src, len, out + index[i]);
+        if (clen >= len) {
+            memcpy(out + index[i], src, len);
+            clen = len;
+        }
+        index[i + 1] = index[i] + clen;
+    }
+    if (index[nblocks] >= length) {
+        free(out);
+        return 0;
+    }
+    *size = index[nblocks];
+    return out;
+}
+
+/*
+ * Build the hash table of n names: the number of buckets, the buckets, the
+ * chain links and the hashes, all 32 bit. Buckets and links hold the index
+ * of an entry plus one, zero ends a chain.
+ */
+static unsigned int *build_hash(const char **names, int n, unsigned int *size)
+{
+    unsigned int nbuckets = 1, i;
+    while (nbuckets < (unsigned int) n)
+        nbuckets <<= 1;
+
+    *size = (1 + nbuckets + 2 * n) * sizeof(unsigned int);
+    unsigned int *table = calloc(1, *size);
+    unsigned int *buckets = table + 1;
+    unsigned int *next = buckets + nbuckets;
+    unsigned int *hashes = next + n;
+
+    table[0] = nbuckets;
+    for (i = 0; i < (unsigned int) n; ++i) {
+        hashes[i] = hash_name(names[i]);
+        next[i] = buckets[hashes[i] & (nbuckets - 1)];
+        buckets[hashes[i] & (nbuckets - 1)] = i + 1;
+    }
+    return table;
+}
+
+/*
+ * Read a whole host file.
+ */
+static unsigned char *read_file(const char *path, unsigned int *length)
+{
+    FILE *stream = fopen(path, "r");
+    if (!stream) {
+        perror(path);
+        exit(1);
+    }
+    fseek(stream, 0, SEEK_END);
+    *length = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    unsigned char *buf = malloc(*length ? *length : 1);
+    if (fread(buf, 1, *length, stream) != *length) {
+        perror(path);
+        exit(1);
+    }
+    fclose(stream);
+    return buf;
+}
+
+static void pad_to(FILE *stream, long offset)
+{
+    while (ftell(stream) < offset)
+        fputc(0, stream);
+}
+
+static int add_node(const char *name, int len, int dir, int parent)
+{
+    struct node *n = &nodes[nnodes];
+    memcpy(n->name, name, len);
+    n->name[len] = 0;
+    n->dir = dir;
+    n->child = n->sibling = n->last_child = -1;
+    if (parent >= 0) {
+        if (nodes[parent].last_child >= 0)
+            nodes[nodes[parent].last_child].sibling = nnodes;
+        else
+            nodes[parent].child = nnodes;
+        nodes[parent].last_child = nnodes;
+    }
+    return nnodes++;
+}
+
+/*
+ * Add a file at given path, creating the directories leading to it.
+ */
+static void add_path(const char *path, const char *source)
+{
+    int parent = 0;
+    for (;;) {
+        const char *slash = strchr(path, '/');
+        int len = slash ? slash - path : (int) strlen(path);
+        if (!len || len > NAME_MAX) {
+            fprintf(stderr, "Bad path component in %s\n", path);
+            exit(1);
+        }
+
+        int i;
+        for (i = nodes[parent].child; i >= 0; i = nodes[i].sibling) {
+            if ((int) strlen(nodes[i].name) == len
+                    && !strncmp(nodes[i].name, path, len))
+                break;
+        }
+        if (!slash) {
+            if (i >= 0) {
+                fprintf(stderr, "Duplicate path %s\n", path);
+                exit(1);
+            }
+            nodes[add_node(path, len, 0, parent)].source = source;
+            return;
+        }
+        if (i < 0)
+            i = add_node(path, len, 1, parent);
+        else if (!nodes[i].dir) {
+            fprintf(stderr, "%.*s is a file\n", len, path);
+            exit(1);
+        }
+        parent = i;
+        path = slash + 1;
+    }
+}
+
+static int write_v2(int nfiles, char *argv[], int compress)
+{
+    /* At most one directory per path component. */
+    int max = 1, i;
+    for (i = 0; i < nfiles; ++i) {
+        const char *p;
+        for (p = argv[i*2+2]; *p; ++p)
+            max += *p == '/';
+        max++;
+    }
+    nodes = calloc(max, sizeof(struct node));
+    add_node("", 0, 1, -1);
+    for (i = 0; i < nfiles; ++i)
+        add_path(argv[i*2+2], argv[i*2+1]);
+
+    /* Order the entries breadth first, so that the children of every
+     * directory are consecutive. */
+    int *order = malloc(nnodes * sizeof(int));
+    int count = 1, pos;
+    order[0] = 0;
+    for (pos = 0; pos < count; ++pos) {
+        nodes[order[pos]].index = pos;
+        int c;
+        for (c = nodes[order[pos]].child; c >= 0; c = nodes[c].sibling)
+            order[count++] = c;
+    }
+
+    struct initrd2_entry *entries = calloc(nnodes, sizeof(*entries));
+    const char **names = malloc(nnodes * sizeof(char *));
+    unsigned int names_size = 0;
+    for (pos = 0; pos < nnodes; ++pos) {
+        struct node *n = &nodes[order[pos]];
+        names[pos] = n->name;
+        entries[pos].name = names_size;
+        names_size += strlen(n->name) + 1;
+        if (n->dir) {
+            entries[pos].flags = INITRD2_DIR;
+            entries[pos].offset = n->child >= 0 ? nodes[n->child].index : 0;
+            for (i = n->child; i >= 0; i = nodes[i].sibling)
+                entries[pos].length++;
+        } else {
+            entries[pos].flags = INITRD2_FILE;
+        }
+    }
+
+    unsigned int hash_size;
+    unsigned int *hash = build_hash(names, nnodes, &hash_size);
+
+    struct initrd2_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = INITRD2_MAGIC;
+    header.version = 2;
+    header.nentries = nnodes;
+    header.entries = sizeof(header);
+    header.hash = header.entries + nnodes * sizeof(*entries);
+    header.names = header.hash + hash_size;
+
+    /* Every file starts on its own page, so it can be mapped in place. */
+    unsigned int off = header.names + names_size;
+    unsigned char **data = calloc(nnodes, sizeof(unsigned char *));
+    unsigned int *stored = calloc(nnodes, sizeof(unsigned int));
+    for (pos = 0; pos < nnodes; ++pos) {
+        struct node *n = &nodes[order[pos]];
+        if (n->dir)
+            continue;
+        off = (off + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        data[pos] = read_file(n->source, &entries[pos].length);
+        stored[pos] = entries[pos].length;
+        if (compress) {
+            unsigned char *packed =
+                compress_file(data[pos], entries[pos].length, &stored[pos]);
+            if (packed) {
+                free(data[pos]);
+                data[pos] = packed;
+                entries[pos].flags |= INITRD2_LZ4;
+            }
+        }
+        entries[pos].offset = off;
+        entries[pos].crc = crc32(data[pos], stored[pos]);
+        printf("Writing file %s -> %s at 0x%x (%u bytes)\n",
+                n->source, n->name, off, stored[pos]);
+        off += stored[pos];
+    }
+    header.size = off;
+
+    FILE *wstream = fopen("./initrd.img", "w");
+    fwrite(&header, sizeof(header), 1, wstream);
+    fwrite(entries, sizeof(*entries), nnodes, wstream);
+    fwrite(hash, 1, hash_size, wstream);
+    for (pos = 0; pos < nnodes; ++pos)
+        fwrite(names[pos], 1, strlen(names[pos]) + 1, wstream);
+    for (pos = 0; pos < nnodes; ++pos) {
+        if (!data[pos])
+            continue;
+        pad_to(wstream, entries[pos].offset);
+        fwrite(data[pos], 1, stored[pos], wstream);
+        free(data[pos]);
+    }
+    fclose(wstream);
+    return 0;
+}
+
+static int write_v1(int nheaders, char *argv[])
 {
-    int nheaders = (argc-1) / 2;
     struct initrd_header headers[64];
 
-    printf("size of header: %lu\n", sizeof(struct initrd_header));
+    /* One slot is taken by the hash table. */
+    if (nheaders > 63) {
+        fprintf(stderr, "Too many files, at most 63 fit\n");
+        return 1;
+    }
+    memset(headers, 0, sizeof(headers));
+
     unsigned int off = sizeof(struct initrd_header) * 64 + sizeof(int);
+    const char *names[64];
     int i;
 
     for (i = 0; i < nheaders; ++i) {
         printf("Writing file %s -> %s at 0x%x\n",
                 argv[i*2+1], argv[i*2+2], off);
-        strcpy(headers[i].name, argv[i*2+2]);
-        headers[i].offset = off;
-        FILE *stream = fopen(argv[i*2+1], "r");
-        if (!stream) {
-            perror("Can not open file");
+        if (strlen(argv[i*2+2]) > 63 || strchr(argv[i*2+2], '/')) {
+            fprintf(stderr, "Bad file name %s\n", argv[i*2+2]);
             return 1;
         }
-        fseek(stream, 0, SEEK_END);
-        headers[i].length = ftell(stream);
+        strcpy(headers[i].name, argv[i*2+2]);
+        names[i] = headers[i].name;
+        headers[i].offset = off;
+        free(read_file(argv[i*2+1], &headers[i].length));
         off += headers[i].length;
-        fclose(stream);
         headers[i].magic = 0xBF;
     }
 
+    unsigned int hash_size;
+    unsigned int *hash = build_hash(names, nheaders, &hash_size);
+    strcpy(headers[nheaders].name, HASH_NAME);
+    headers[nheaders].offset = off;
+    headers[nheaders].length = hash_size;
+    headers[nheaders].magic = 0xBF;
+    int nentries = nheaders + 1;
+
     FILE *wstream = fopen("./initrd.img", "w");
-    fwrite(&nheaders, sizeof(int), 1, wstream);
+    fwrite(&nentries, sizeof(int), 1, wstream);
     fwrite(headers, sizeof(struct initrd_header), 64, wstream);
 
     for (i = 0; i < nheaders; i++) {
-        FILE *stream = fopen(argv[i*2+1], "r");
-        unsigned char *buf = malloc(headers[i].length);
-        fread(buf, 1, headers[i].length, stream);
-        fwrite(buf, 1, headers[i].length, wstream);
-        fclose(stream);
+        unsigned int length;
+        unsigned char *buf = read_file(argv[i*2+1], &length);
+        fwrite(buf, 1, length, wstream);
         free(buf);
     }
+    fwrite(hash, 1, hash_size, wstream);
+    free(hash);
 
     fclose(wstream);
 
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    int v1 = 0, compress = 0;
+    while (argc > 1 && (!strcmp(argv[1], "-1") || !strcmp(argv[1], "-z"))) {
+        if (argv[1][1] == '1')
+            v1 = 1;
+        else
+            compress = 1;
+        argv++;
+        argc--;
+    }
+    if (argc < 1 || (argc - 1) % 2 || (v1 && compress)) {
+        fprintf(stderr, "usage: gen-initrd [-1 | -z] [source path]...\n");
+        return 1;
+    }
+
+    int nfiles = (argc-1) / 2;
+    return v1 ? write_v1(nfiles, argv) : write_v2(nfiles, argv, compress);
+}
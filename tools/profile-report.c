@@ -0,0 +1,307 @@
+/*
+ * profile-report.c -- Symbolise samples of the kernel profiler.
+ *
+ * Reads the serial output of profile_dump() and the kernel image, and
+ * prints a flat profile of the functions in which the samples were taken.
+ * With -f, the samples are also written as folded stacks, one line per
+ * distinct stack, which flamegraph.pl turns into a flame graph.
+ *
+ * Usage: profile-report [-f folded.txt] src/kernel serial.log
+ */
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DEPTH   16
+
+struct symbol {
+    unsigned int addr;
+    unsigned int size;
+    const char *name;
+    unsigned long samples;
+};
+
+struct sample {
+    unsigned int pid;
+    int user;
+    int depth;
+    unsigned int pc[MAX_DEPTH];
+};
+
+static struct symbol *symbols;
+static int nsymbols;
+
+static void *read_file(const char *path, long *size)
+{
+    FILE *stream = fopen(path, "rb");
+    if (!stream) {
+        perror(path);
+        exit(1);
+    }
+    fseek(stream, 0, SEEK_END);
+    *size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    char *buf = malloc(*size + 1);
+    if (fread(buf, 1, *size, stream) != (size_t) *size) {
+        perror(path);
+        exit(1);
+    }
+    buf[*size] = 0;
+    fclose(stream);
+    return buf;
+}
+
+static int cmp_symbol(const void *a, const void *b)
+{
+    const struct symbol *sa = a, *sb = b;
+    if (sa->addr != sb->addr)
+        return sa->addr < sb->addr ? -1 : 1;
+    /* Prefer symbols with a size, they come from C code. */
+    return sa->size < sb->size ? 1 : sa->size > sb->size ? -1 : 0;
+}
+
+/*
+ * Collect symbols in executable sections of the kernel. Assembly labels
+ * have no size, they extend up to the next symbol.
+ */
+static void load_symbols(const char *path)
+{
+    long size;
+    unsigned char *image = read_file(path, &size);
+    Elf32_Ehdr *ehdr = (Elf32_Ehdr *) image;
+
+    if (size < (long) sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+            ehdr->e_ident[EI_CLASS] != ELFCLASS32) {
+        fprintf(stderr, "%s: not a 32-bit ELF file\n", path);
+        exit(1);
+    }
+
+    Elf32_Shdr *shdrs = (Elf32_Shdr *) (image + ehdr->e_shoff);
+    int i, j;
+    for (i = 0; i < ehdr->e_shnum; ++i) {
+        if (shdrs[i].sh_type != SHT_SYMTAB)
+            continue;
+        Elf32_Sym *syms = (Elf32_Sym *) (image + shdrs[i].sh_offset);
+        int count = shdrs[i].sh_size / sizeof(Elf32_Sym);
+        const char *strtab = (const char *) image +
+            shdrs[shdrs[i].sh_link].sh_offset;
+
+        symbols = realloc(symbols, (nsymbols + count) * sizeof(*symbols));
+        for (j = 0; j < count; ++j) {
+            Elf32_Sym *sym = &syms[j];
+            int type = ELF32_ST_TYPE(sym->st_info);
+            if (type != STT_FUNC && type != STT_NOTYPE)
+                continue;
+            if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= ehdr->e_shnum)
+                continue;
+            if (!(shdrs[sym->st_shndx].sh_flags & SHF_EXECINSTR))
+                continue;
+            if (!strtab[sym->st_name])
+                continue;
+            symbols[nsymbols].addr = sym->st_value;
+            symbols[nsymbols].size = sym->st_size;
+            symbols[nsymbols].name = strtab + sym->st_name;
+            symbols[nsymbols].samples = 0;
+            nsymbols++;
+        }
+    }
+    if (!nsymbols) {
+        fprintf(stderr, "%s: no symbols found\n", path);
+        exit(1);
+    }
+
+    qsort(symbols, nsymbols, sizeof(*symbols), cmp_symbol);
+    /* Drop aliases and give sizes to labels. */
+    for (i = 0, j = 0; i < nsymbols; ++i) {
+        if (j && symbols[j - 1].addr == symbols[i].addr)
+            continue;
+        symbols[j++] = symbols[i];
+    }
+    nsymbols = j;
+    for (i = 0; i < nsymbols - 1; ++i) {
+        if (!symbols[i].size)
+            symbols[i].size = symbols[i + 1].addr - symbols[i].addr;
+    }
+}
+
+static struct symbol *lookup(unsigned int addr)
+{
+    int lo = 0, hi = nsymbols - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    if (hi < 0)
+        return NULL;
+    struct symbol *sym = &symbols[hi];
+    if (sym->size && addr - sym->addr >= sym->size)
+        return NULL;
+    return sym;
+}
+
+/*
+ * Append name of the function containing addr to buf.
+ */
+static void append_frame(char *buf, size_t len, unsigned int addr)
+{
+    struct symbol *sym = lookup(addr);
+    size_t used = strlen(buf);
+    if (sym)
+        snprintf(buf + used, len - used, "%s", sym->name);
+    else
+        snprintf(buf + used, len - used, "0x%x", addr);
+}
+
+static int cmp_string(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int cmp_samples(const void *a, const void *b)
+{
+    const struct symbol *sa = *(struct symbol * const *) a;
+    const struct symbol *sb = *(struct symbol * const *) b;
+    if (sa->samples != sb->samples)
+        return sa->samples < sb->samples ? 1 : -1;
+    return strcmp(sa->name, sb->name);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: profile-report [-f folded.txt] kernel log\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *folded_path = NULL;
+    int arg = 1;
+    if (arg + 1 < argc && !strcmp(argv[arg], "-f")) {
+        folded_path = argv[arg + 1];
+        arg += 2;
+    }
+    if (argc - arg != 2)
+        usage();
+
+    load_symbols(argv[arg]);
+
+    long size;
+    char *log = read_file(argv[arg + 1], &size);
+
+    struct sample *samples = NULL;
+    int nsamples = 0, capacity = 0;
+    unsigned long lost = 0, user = 0, unknown = 0;
+    unsigned int hz = 0;
+
+    char *line;
+    for (line = strtok(log, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        if (!strncmp(line, "@profile ", 9)) {
+            hz = strtoul(line + 9, NULL, 16);
+        } else if (!strncmp(line, "L ", 2)) {
+            unsigned int cpu, n;
+            if (sscanf(line + 2, "%x %x", &cpu, &n) == 2)
+                lost += n;
+        } else if (!strncmp(line, "S ", 2)) {
+            struct sample s;
+            char mode;
+            int used;
+            unsigned int cpu;
+            if (sscanf(line + 2, "%x %x %c %x%n", &cpu, &s.pid, &mode,
+                        &s.pc[0], &used) != 4)
+                continue;
+            s.user = mode == 'u';
+            s.depth = 1;
+            char *p = line + 2 + used;
+            while (s.depth < MAX_DEPTH) {
+                char *end;
+                unsigned long ret = strtoul(p, &end, 16);
+                if (end == p)
+                    break;
+                /* The call instruction precedes the return address. */
+                s.pc[s.depth++] = ret - 1;
+                p = end;
+            }
+            if (nsamples == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                samples = realloc(samples, capacity * sizeof(*samples));
+            }
+            samples[nsamples++] = s;
+        }
+    }
+
+    if (!nsamples) {
+        fprintf(stderr, "%s: no samples found\n", argv[arg + 1]);
+        return 1;
+    }
+
+    /* Flat profile: samples by function they were taken in. */
+    int i, j;
+    for (i = 0; i < nsamples; ++i) {
+        if (samples[i].user) {
+            user++;
+            continue;
+        }
+        struct symbol *sym = lookup(samples[i].pc[0]);
+        if (sym)
+            sym->samples++;
+        else
+            unknown++;
+    }
+
+    struct symbol **sorted = malloc(nsymbols * sizeof(*sorted));
+    int nsorted = 0;
+    for (i = 0; i < nsymbols; ++i) {
+        if (symbols[i].samples)
+            sorted[nsorted++] = &symbols[i];
+    }
+    qsort(sorted, nsorted, sizeof(*sorted), cmp_samples);
+
+    printf("%d samples at %u Hz per processor, %lu lost\n",
+            nsamples, hz, lost);
+    printf("%8s %7s  %s\n", "samples", "%", "function");
+    for (i = 0; i < nsorted; ++i) {
+        printf("%8lu %6.2f%%  %s\n", sorted[i]->samples,
+                100.0 * sorted[i]->samples / nsamples, sorted[i]->name);
+    }
+    if (unknown)
+        printf("%8lu %6.2f%%  [unknown]\n", unknown, 100.0 * unknown / nsamples);
+    if (user)
+        printf("%8lu %6.2f%%  [user]\n", user, 100.0 * user / nsamples);
+
+    if (!folded_path)
+        return 0;
+
+    /* Folded stacks: "pid-N;outermost;...;innermost count". */
+    char **stacks = malloc(nsamples * sizeof(*stacks));
+    for (i = 0; i < nsamples; ++i) {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "pid-%u", samples[i].pid);
+        if (samples[i].user) {
+            strncat(buf, ";[user]", sizeof(buf) - strlen(buf) - 1);
+        } else {
+            for (j = samples[i].depth - 1; j >= 0; --j) {
+                strncat(buf, ";", sizeof(buf) - strlen(buf) - 1);
+                append_frame(buf, sizeof(buf), samples[i].pc[j]);
+            }
+        }
+        stacks[i] = strdup(buf);
+    }
+    qsort(stacks, nsamples, sizeof(*stacks), cmp_string);
+
+    FILE *out = fopen(folded_path, "w");
+    if (!out) {
+        perror(folded_path);
+        return 1;
+    }
+    for (i = 0; i < nsamples; i = j) {
+        for (j = i + 1; j < nsamples && !strcmp(stacks[i], stacks[j]); ++j);
+        fprintf(out, "%s %d\n", stacks[i], j - i);
+    }
+    fclose(out);
+    return 0;
+}
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-./tools/gen-initrd data/keymaps/us.keymap us.keymap
+./tools/gen-initrd -z data/keymaps/us.keymap us.keymap